@@ -1,6 +1,22 @@
+/* Hot functions are compiled to machine code on x86-64 Linux */
+#if defined(__x86_64__) && defined(__linux__)
+#define LJIT 1
+#define _DEFAULT_SOURCE
+#else
+#define LJIT 0
+#endif
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include "lib/mpc.h"
 
+#if LJIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 /* If we are compiling on Windows compile these functions */
 #ifdef _WIN32
 
@@ -43,7 +59,7 @@ void add_history(char *unused) {}
 
 #define LASSERT_TYPE(a, i, t, func)                                                                                                 \
 	{                                                                                                                               \
-		enum lval_type lt = a->cell[i]->type;                                                                                       \
+		enum lval_type lt = LTYPE(a->cell[i]);                                                                                       \
 		if (lt != t)                                                                                                                \
 		{                                                                                                                           \
 			lval *err = lval_err("Function '%s' passed incorrect type. Expected %s, got %s.", func, ltype_name(t), ltype_name(lt)); \
@@ -62,17 +78,61 @@ void add_history(char *unused) {}
 /* Forward Declarations */
 struct lval;
 struct lenv;
+struct lcode;
+struct vm_insn;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lcode lcode;
+/*
+ * Builtins own the list of arguments they are passed. Its values may be shared
+ * with bindings and other lists, so a builtin reads them as they are, takes a
+ * share with lval_copy of any it keeps, and calls lval_unshare on any it is
+ * about to modify, which copies it only if it is shared.
+ */
 typedef lval *(*lbuiltin)(lenv *, lval *);
+typedef int (*ljit_fn)(int pc);
+typedef long (*laot_fn)(long *a);
 lval *lval_eval(lenv *e, lval *v);
+lval *lenv_lookup(lenv *e, lval *k);
 lval *lenv_get(lenv *e, lval *k);
 char *find_builtin(lenv *e, lbuiltin b);
 lenv *lenv_new();
+void lenv_reserve(lenv *e, int n);
 lenv *lenv_copy(lenv *e);
 void lenv_del(lenv *e);
+void lval_close(lval *f, lenv *e);
+void lval_collect(lenv *e);
 void lval_print(lenv *e, lval *v);
+lval *lval_eval_call(lenv *e, lval *v);
+lval *vm_eval_expr(lenv *e, lval *v);
+lval *lval_eval_single(lenv *e, lval *x);
 lval *lval_call(lenv *e, lval *f, lval *a);
+int lval_unbound(lval *f);
+lval *lval_run(lenv *e, lval *f);
+lval *vm_run(lenv *e, lcode *c, lval *f);
+lcode *lval_code(lval *body);
+lval *builtin_eval(lenv *e, lval *a);
+lval *builtin_if(lenv *e, lval *a);
+lval *builtin_memstats(lenv *e, lval *a);
+lval *builtin_exit(lenv *e, lval *a);
+lval *builtin_deflist(lenv *e, lval *a);
+lval *builtin_let(lenv *e, lval *a);
+lval *builtin_do(lenv *e, lval *a);
+lval *builtin_put(lenv *e, lval *a);
+lval *builtin_select(lenv *e, lval *a);
+lval *builtin_case(lenv *e, lval *a);
+lval *lval_clause(lenv *e, lval *a, int keyed);
+lval *builtin_lt(lenv *e, lval *a);
+lval *builtin_gt(lenv *e, lval *a);
+lval *builtin_le(lenv *e, lval *a);
+lval *builtin_ge(lenv *e, lval *a);
+lval *builtin_eq(lenv *e, lval *a);
+lval *builtin_ne(lenv *e, lval *a);
+int lval_eq(lval *x, lval *y);
+void lcode_del(lcode *c);
+void jit_compile(lcode *c);
+void lcode_thread(lcode *c);
+lval *lval_call_aot(lval *f, lval **a, int n);
 mpc_parser_t *Number;
 mpc_parser_t *Symbol;
 mpc_parser_t *String;
@@ -92,30 +152,127 @@ enum lval_type
 	LVAL_FUN,
 	LVAL_SEXPR,
 	LVAL_QEXPR,
-	LVAL_EXIT
+	LVAL_EXIT,
+	LVAL_BOX
 };
 
+/* Flags kept in the lval header */
+#define LVAL_BUILTIN 1
+#define LVAL_FROZEN 2
+#define LVAL_VARIADIC 4
+#define LVAL_SCANNED 8
+#define LVAL_ASSIGNS 16
+#define LVAL_MARKED 32
+#define LVAL_SLICE 64
+
+/* Only the fields of the variant matching type are valid */
 struct lval
 {
-	enum lval_type type;
+	unsigned char type;
+	unsigned char flags;
 
-	/* Basic */
-	long num;
-	char *err;
-	char *sym;
-	char *str;
+	/* Number of owners sharing this value */
+	int refs;
 
-	/* Function */
-	lbuiltin builtin;
-	lenv *env;
-	lval *formals;
-	lval *body;
+	union
+	{
+		/* Number too large to be an immediate */
+		long num;
+
+		/* Basic */
+		char *err;
+		char *str;
+
+		/*
+		 * Symbol, with the frame slot it is expected to be bound at, and the
+		 * global binding it was last found in while lenv_version was version
+		 */
+		struct
+		{
+			char *sym;
+			int slot;
+			int global;
+			unsigned long version;
+		};
 
-	/* Expression */
-	int count;
-	struct lval **cell;
+		/* Builtin function */
+		lbuiltin builtin;
+
+		/* User defined function */
+		struct
+		{
+			lenv *env;
+			lval *formals;
+			lval *body;
+		};
+
+		/*
+		 * Expression, with the bytecode compiled from it if it has been run as a
+		 * function body. The values start front pointers into the cell array, or
+		 * for a slice, into the cells of the list base.
+		 */
+		struct
+		{
+			int count;
+			int front;
+			struct lval **cell;
+			union
+			{
+				lcode *code;
+				struct lval *base;
+			};
+		};
+
+		/* Binding shared by a frame and the lambdas made in it, see lenv_box, in the list of every box */
+		struct
+		{
+			struct lval *boxed;
+			struct lval *box_prev;
+			struct lval *box_next;
+		};
+	};
 };
 
+/* Keep lvals small enough for two to share a cache line */
+typedef char lval_size_check[sizeof(lval) <= 32 ? 1 : -1];
+
+#define LVAL_IS_BUILTIN(v) ((v)->flags & LVAL_BUILTIN)
+
+/* Lambdas whose formals end with '&' and a symbol for the rest of the arguments */
+#define LVAL_IS_VARIADIC(v) ((v)->flags & LVAL_VARIADIC)
+
+/*
+ * Lambda bodies, and every list within them, are frozen when the lambda is
+ * made. A frozen list is never modified, even by its only owner, so the code
+ * compiled from it stays valid and it can be run as often as needed without
+ * being copied first.
+ */
+#define LVAL_IS_FROZEN(v) ((v)->flags & LVAL_FROZEN)
+
+/* Frozen bodies once searched for '=', and whether they use it, see lenv_assigns */
+#define LVAL_IS_SCANNED(v) ((v)->flags & LVAL_SCANNED)
+
+/*
+ * A slice is a list that shares the cells of another, its base, from some
+ * point on, which is how 'tail' avoids copying a list held elsewhere. It owns
+ * a share of base rather than its cells, so like a shared list it is copied
+ * before being modified, and before being frozen as frozen lists keep their
+ * code where a slice keeps its base.
+ */
+#define LVAL_IS_SLICE(v) ((v)->flags & LVAL_SLICE)
+
+/*
+ * Numbers that fit in all but one bit of a long are not allocated at all. They
+ * are stored in the lval pointer itself, shifted up by one with the low bit set,
+ * which a real lval pointer never has. Always use LTYPE and LNUM to read the
+ * type and number of an lval that may be an immediate.
+ */
+#define LVAL_IS_IMM(v) (((uintptr_t)(v)) & 1)
+#define LVAL_IMM_MIN (LONG_MIN / 2)
+#define LVAL_IMM_MAX (LONG_MAX / 2)
+#define LTYPE(v) (LVAL_IS_IMM(v) ? LVAL_NUM : (v)->type)
+#define LNUM(v) (LVAL_IS_IMM(v) ? (long)((intptr_t)(v) >> 1) : (v)->num)
+
 char *ltype_name(enum lval_type t)
 {
 	switch (t)
@@ -136,15 +293,259 @@ char *ltype_name(enum lval_type t)
 		return "Q-Expression";
 	case LVAL_EXIT:
 		return "Exit";
+	case LVAL_BOX:
+		return "Box";
 	default:
 		return "Unknown";
 	}
 }
 
+/* Number of lvals carved out of each slab */
+#define LVAL_SLAB_SIZE 1024
+
+/* Cell arrays up to 2^(CELL_CLASSES - 1) pointers are pooled by size class */
+#define CELL_CLASSES 8
+
+/* Slab allocator for lvals */
+struct lval_pool
+{
+	/* Free list of released lvals, threaded through the lvals themselves */
+	lval *free_list;
+
+	/* Bump region of the current slab for lvals that have never been used */
+	lval *slab_next;
+	lval *slab_end;
+
+	/* Allocation counters reported by 'memstats' */
+	long live;
+	long recycled;
+};
+
+/*
+ * Values are freed by reference counting as soon as their last owner lets go
+ * of them, in place of a tracing collector, so they are not split into
+ * generations. Only boxes can form cycles, which lval_collect traces.
+ */
+struct lval_pool lval_pool;
+
+/* Shares of values taken, and values copied because a shared one was about to be modified */
+long lval_copies = 0;
+long lval_unshared = 0;
+
+/* Free lists of released cell arrays, one per size class */
+lval **cell_free_lists[CELL_CLASSES];
+
+long cells_live = 0;
+long cells_recycled = 0;
+
+lval *lval_alloc(void)
+{
+	struct lval_pool *p = &lval_pool;
+	lval *v;
+
+	/* Prefer recently released lvals as they are likely still in cache */
+	if (p->free_list)
+	{
+		v = p->free_list;
+		p->free_list = *(lval **)v;
+		p->recycled++;
+	}
+	else
+	{
+		/* Start a new slab once the current one is used up */
+		if (p->slab_next == p->slab_end)
+		{
+			p->slab_next = malloc(sizeof(lval) * LVAL_SLAB_SIZE);
+			p->slab_end = p->slab_next + LVAL_SLAB_SIZE;
+		}
+		v = p->slab_next++;
+	}
+
+	p->live++;
+	v->refs = 1;
+	v->flags = 0;
+	return v;
+}
+
+void lval_free(lval *v)
+{
+	struct lval_pool *p = &lval_pool;
+	*(lval **)v = p->free_list;
+	p->free_list = v;
+	p->live--;
+}
+
+/* Size class of a cell array holding count pointers */
+int cell_class(int count)
+{
+	int c = 0;
+	while ((1 << c) < count)
+	{
+		c++;
+	}
+	return c;
+}
+
+/* Number of pointers actually reserved for a cell array of count pointers */
+int cell_capacity(int count)
+{
+	return 1 << cell_class(count);
+}
+
+lval **cells_alloc(int count)
+{
+	if (count == 0)
+	{
+		return NULL;
+	}
+
+	cells_live++;
+	int c = cell_class(count);
+	if (c < CELL_CLASSES && cell_free_lists[c])
+	{
+		lval **cell = cell_free_lists[c];
+		cell_free_lists[c] = *(lval ***)cell;
+		cells_recycled++;
+		return cell;
+	}
+	return malloc(sizeof(lval *) * cell_capacity(count));
+}
+
+void cells_free(lval **cell, int count)
+{
+	if (!cell)
+	{
+		return;
+	}
+
+	cells_live--;
+	int c = cell_class(count);
+	if (c < CELL_CLASSES)
+	{
+		*(lval ***)cell = cell_free_lists[c];
+		cell_free_lists[c] = cell;
+		return;
+	}
+	free(cell);
+}
+
+/* Resize a cell array of old_count pointers to hold new_count pointers */
+lval **cells_resize(lval **cell, int old_count, int new_count)
+{
+	/* Nothing to do while the size class stays the same */
+	if (cell && new_count && cell_class(old_count) == cell_class(new_count))
+	{
+		return cell;
+	}
+
+	/* Large arrays are grown and shrunk in place */
+	if (cell && new_count && cell_class(old_count) >= CELL_CLASSES && cell_class(new_count) >= CELL_CLASSES)
+	{
+		return realloc(cell, sizeof(lval *) * cell_capacity(new_count));
+	}
+
+	/* Otherwise move the contents to an array of the new size class */
+	lval **n = cells_alloc(new_count);
+	int keep = old_count < new_count ? old_count : new_count;
+	if (keep)
+	{
+		memcpy(n, cell, sizeof(lval *) * keep);
+	}
+	cells_free(cell, old_count);
+	return n;
+}
+
+/* Interned symbol names, in an open addressing table that is kept at most half full */
+char **intern_table = NULL;
+int intern_size = 0;
+int intern_count = 0;
+
+/* Name of the symbol that introduces variable arguments */
+char *sym_varargs;
+
+/* Name of the builtin binding in the current frame */
+char *sym_put;
+
+/* Interned names are stored after a header of facts about the symbol */
+struct lsym
+{
+	/* Whether the symbol has ever been bound anywhere but the global environment */
+	int shadowed;
+	char name[];
+};
+
+#define LSYM(s) ((struct lsym *)((s) - offsetof(struct lsym, name)))
+
+unsigned long intern_hash(char *s)
+{
+	/* FNV-1a */
+	unsigned long h = 2166136261UL;
+	while (*s)
+	{
+		h = (h ^ (unsigned char)*s++) * 16777619UL;
+	}
+	return h;
+}
+
+void intern_grow(void)
+{
+	char **old = intern_table;
+	int old_size = intern_size;
+
+	intern_size = old_size ? old_size * 2 : 256;
+	intern_table = calloc(intern_size, sizeof(char *));
+
+	for (int i = 0; i < old_size; i++)
+	{
+		if (old[i])
+		{
+			unsigned long j = intern_hash(old[i]) & (intern_size - 1);
+			while (intern_table[j])
+			{
+				j = (j + 1) & (intern_size - 1);
+			}
+			intern_table[j] = old[i];
+		}
+	}
+	free(old);
+}
+
+/* Return the one shared copy of the symbol name s, so symbols can be compared by pointer */
+char *intern(char *s)
+{
+	if (2 * (intern_count + 1) > intern_size)
+	{
+		intern_grow();
+	}
+
+	unsigned long i = intern_hash(s) & (intern_size - 1);
+	while (intern_table[i])
+	{
+		if (strcmp(intern_table[i], s) == 0)
+		{
+			return intern_table[i];
+		}
+		i = (i + 1) & (intern_size - 1);
+	}
+
+	/* First time we have seen this name */
+	struct lsym *x = calloc(1, sizeof(struct lsym) + strlen(s) + 1);
+	strcpy(x->name, s);
+	intern_table[i] = x->name;
+	intern_count++;
+	return intern_table[i];
+}
+
 /* Construct a pointer to a new Number lval */
 lval *lval_num(long x)
 {
-	lval *v = malloc(sizeof(lval));
+	if (x >= LVAL_IMM_MIN && x <= LVAL_IMM_MAX)
+	{
+		return (lval *)(((uintptr_t)x << 1) | 1);
+	}
+
+	/* Only numbers too large for an immediate live on the heap */
+	lval *v = lval_alloc();
 	v->type = LVAL_NUM;
 	v->num = x;
 	return v;
@@ -153,7 +554,7 @@ lval *lval_num(long x)
 /* Construct a pointer to a new Error lval */
 lval *lval_err(char *fmt, ...)
 {
-	lval *v = malloc(sizeof(lval));
+	lval *v = lval_alloc();
 	v->type = LVAL_ERR;
 
 	/* Create a va list and initialize it */
@@ -177,17 +578,18 @@ lval *lval_err(char *fmt, ...)
 /* Construct a pointer to a new Symbol lval */
 lval *lval_sym(char *s)
 {
-	lval *v = malloc(sizeof(lval));
+	lval *v = lval_alloc();
 	v->type = LVAL_SYM;
-	v->sym = malloc(strlen(s) + 1);
-	strcpy(v->sym, s);
+	v->sym = intern(s);
+	v->slot = 0;
+	v->version = 0;
 	return v;
 }
 
 /* Construct a pointer to a new String lval */
 lval *lval_str(char *s)
 {
-	lval *v = malloc(sizeof(lval));
+	lval *v = lval_alloc();
 	v->type = LVAL_STR;
 	v->str = malloc(strlen(s) + 1);
 	strcpy(v->str, s);
@@ -197,8 +599,9 @@ lval *lval_str(char *s)
 /* Construct a pointer to a new Function lval */
 lval *lval_builtin(lbuiltin func)
 {
-	lval *v = malloc(sizeof(lval));
+	lval *v = lval_alloc();
 	v->type = LVAL_FUN;
+	v->flags |= LVAL_BUILTIN;
 	v->builtin = func;
 	return v;
 }
@@ -206,27 +609,31 @@ lval *lval_builtin(lbuiltin func)
 /* Construct a pointer to a new empty Sexpr lval */
 lval *lval_sexpr(void)
 {
-	lval *v = malloc(sizeof(lval));
+	lval *v = lval_alloc();
 	v->type = LVAL_SEXPR;
 	v->count = 0;
+	v->front = 0;
 	v->cell = NULL;
+	v->code = NULL;
 	return v;
 }
 
 /* Construct a pointer to a new empty Qexpr lval */
 lval *lval_qexpr(void)
 {
-	lval *v = malloc(sizeof(lval));
+	lval *v = lval_alloc();
 	v->type = LVAL_QEXPR;
 	v->count = 0;
+	v->front = 0;
 	v->cell = NULL;
+	v->code = NULL;
 	return v;
 }
 
 /* Construct a pointer to a new Exit lval */
 lval *lval_exit(void)
 {
-	lval *v = malloc(sizeof(lval));
+	lval *v = lval_alloc();
 	v->type = LVAL_EXIT;
 	v->count = 0;
 	v->cell = NULL;
@@ -235,19 +642,57 @@ lval *lval_exit(void)
 
 lval *lval_lambda(lval *formals, lval *body)
 {
-	lval *v = malloc(sizeof(lval));
+	lval *v = lval_alloc();
 
 	v->type = LVAL_FUN;
-	v->builtin = NULL;
 	v->env = lenv_new();
 	v->formals = formals;
 	v->body = body;
+	if (formals->count >= 2 && formals->cell[formals->count - 2]->sym == sym_varargs)
+	{
+		v->flags |= LVAL_VARIADIC;
+	}
+
+	return v;
+}
+
+/* Every box, most recently made first, and the number made since lval_collect last looked at them */
+lval *lval_boxes = NULL;
+long lval_boxes_made = 0;
+
+/* Boxes made before the VM stops to collect them while running, see lval_collect */
+#define LVAL_COLLECT_BOXES 1024
+
+long boxes_live = 0;
+long boxes_collected = 0;
+
+/* Construct a box binding x, which may be NULL, taking ownership of x */
+lval *lval_box(lval *x)
+{
+	lval *v = lval_alloc();
+	v->type = LVAL_BOX;
+	v->boxed = x;
 
+	v->box_prev = NULL;
+	v->box_next = lval_boxes;
+	if (lval_boxes)
+	{
+		lval_boxes->box_prev = v;
+	}
+	lval_boxes = v;
+	lval_boxes_made++;
+	boxes_live++;
 	return v;
 }
 
 void lval_del(lval *v)
 {
+	/* Only free the value once its last owner lets go of it */
+	if (LVAL_IS_IMM(v) || --v->refs > 0)
+	{
+		return;
+	}
+
 	switch (v->type)
 	{
 	/* Do nothing special for number/function/exit type */
@@ -256,7 +701,7 @@ void lval_del(lval *v)
 		break;
 
 	case LVAL_FUN:
-		if (!v->builtin)
+		if (!LVAL_IS_BUILTIN(v))
 		{
 			lenv_del(v->env);
 			lval_del(v->formals);
@@ -269,32 +714,91 @@ void lval_del(lval *v)
 		free(v->err);
 		break;
 	case LVAL_SYM:
-		free(v->sym);
+		/* Interned names live for the whole program */
 		break;
 	case LVAL_STR:
 		free(v->str);
 		break;
 
+	case LVAL_BOX:
+		if (v->boxed)
+		{
+			lval_del(v->boxed);
+		}
+		if (v->box_prev)
+		{
+			v->box_prev->box_next = v->box_next;
+		}
+		else
+		{
+			lval_boxes = v->box_next;
+		}
+		if (v->box_next)
+		{
+			v->box_next->box_prev = v->box_prev;
+		}
+		boxes_live--;
+		break;
+
 	/* If Sexpr or Qexpr then delete all elements inside */
 	case LVAL_SEXPR:
 	case LVAL_QEXPR:
+		/* A slice only lets go of the list whose elements it shares */
+		if (LVAL_IS_SLICE(v))
+		{
+			lval_del(v->base);
+			break;
+		}
 		for (int i = 0; i < v->count; i++)
 		{
 			lval_del(v->cell[i]);
 		}
 		/* Also free the memory allocated to contain the pointers */
-		free(v->cell);
+		cells_free(v->cell - v->front, v->front + v->count);
+		if (v->code)
+		{
+			lcode_del(v->code);
+		}
 		break;
 	}
 
-	/* Free the memory allocated for the lval struct itself */
-	free(v);
+	/* Return the lval struct itself to the pool */
+	lval_free(v);
+}
+
+/* Resize the list v, which we own alone, to hold count values, keeping the room in front of them */
+void lval_resize(lval *v, int count)
+{
+	lval **cell = cells_resize(v->cell - v->front, v->front + v->count, v->front + count);
+	v->cell = cell ? cell + v->front : NULL;
+	v->count = count;
+}
+
+/* Make room for n values at the start of the list v, which we own alone */
+void lval_grow_front(lval *v, int n)
+{
+	if (v->front < n)
+	{
+		/* Leave as much room again in front, so that prepending is amortised O(1) */
+		int front = v->count + n;
+		lval **cell = cells_alloc(front + v->count);
+		if (v->count)
+		{
+			memcpy(cell + front, v->cell, sizeof(lval *) * v->count);
+		}
+		cells_free(v->cell - v->front, v->front + v->count);
+		v->cell = cell + front;
+		v->front = front;
+	}
+
+	v->cell -= n;
+	v->front -= n;
+	v->count += n;
 }
 
 lval *lval_add(lval *v, lval *x)
 {
-	v->count++;
-	v->cell = realloc(v->cell, sizeof(lval *) * v->count);
+	lval_resize(v, v->count + 1);
 	v->cell[v->count - 1] = x;
 	return v;
 }
@@ -365,9 +869,21 @@ lval *lval_read(mpc_ast_t *t)
 	return x;
 }
 
+/* Copy v by sharing it, as values are never modified while shared */
 lval *lval_copy(lval *v)
 {
-	lval *x = malloc(sizeof(lval));
+	if (!LVAL_IS_IMM(v))
+	{
+		lval_copies++;
+		v->refs++;
+	}
+	return v;
+}
+
+/* Make a shallow copy of v that shares its contents with v */
+lval *lval_dup(lval *v)
+{
+	lval *x = lval_alloc();
 	x->type = v->type;
 
 	switch (x->type)
@@ -380,13 +896,13 @@ lval *lval_copy(lval *v)
 		x->num = v->num;
 		break;
 	case LVAL_FUN:
-		if (v->builtin)
+		x->flags = v->flags;
+		if (LVAL_IS_BUILTIN(v))
 		{
 			x->builtin = v->builtin;
 		}
 		else
 		{
-			x->builtin = NULL;
 			x->env = lenv_copy(v->env);
 			x->formals = lval_copy(v->formals);
 			x->body = lval_copy(v->body);
@@ -399,29 +915,57 @@ lval *lval_copy(lval *v)
 		strcpy(x->err, v->err);
 		break;
 	case LVAL_SYM:
-		x->sym = malloc(strlen(v->sym) + 1);
-		strcpy(x->sym, v->sym);
+		x->sym = v->sym;
+		x->slot = v->slot;
+		x->global = v->global;
+		x->version = v->version;
 		break;
 	case LVAL_STR:
 		x->str = malloc(strlen(v->str) + 1);
 		strcpy(x->str, v->str);
 		break;
 
-	/* Copy lists by copying each sub-expression */
+	/* Copy lists by sharing each sub-expression */
 	case LVAL_SEXPR:
 	case LVAL_QEXPR:
 		x->count = v->count;
-		x->cell = malloc(sizeof(lval *) * x->count);
+		x->front = 0;
+		x->cell = cells_alloc(x->count);
 		for (int i = 0; i < x->count; ++i)
 		{
 			x->cell[i] = lval_copy(v->cell[i]);
 		}
+		x->code = NULL;
 		break;
 	}
 
 	return x;
 }
 
+/* Return v if we are its only owner and it is neither frozen nor a slice, otherwise a private copy of it that is safe to modify */
+lval *lval_unshare(lval *v)
+{
+	if (LVAL_IS_IMM(v))
+	{
+		return v;
+	}
+	if (v->refs == 1 && !LVAL_IS_FROZEN(v) && !LVAL_IS_SLICE(v))
+	{
+		/* Code compiled from a list would no longer match it once it is modified */
+		if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && v->code)
+		{
+			lcode_del(v->code);
+			v->code = NULL;
+		}
+		return v;
+	}
+
+	lval_unshared++;
+	lval *x = lval_dup(v);
+	lval_del(v);
+	return x;
+}
+
 void lval_expr_print(lenv *e, lval *v, char open, char close)
 {
 	putchar(open);
@@ -450,10 +994,10 @@ void lval_str_print(lval *v)
 /* Print an lval */
 void lval_print(lenv *e, lval *v)
 {
-	switch (v->type)
+	switch (LTYPE(v))
 	{
 	case LVAL_NUM:
-		printf("%li", v->num);
+		printf("%li", LNUM(v));
 		break;
 	case LVAL_ERR:
 		printf("Error: %s", v->err);
@@ -466,16 +1010,24 @@ void lval_print(lenv *e, lval *v)
 		break;
 	case LVAL_FUN:
 	{
-		if (v->builtin)
+		if (LVAL_IS_BUILTIN(v))
 		{
 			char *func = find_builtin(e, v->builtin);
 			printf("<function: %s>", func);
 		}
 		else
 		{
-			printf("(\\ ");
-			lval_print(e, v->formals);
-			putchar(' ');
+			/* A partial application shows the formals it has left */
+			printf("(\\ {");
+			for (int i = v->formals->count - lval_unbound(v); i < v->formals->count; i++)
+			{
+				lval_print(e, v->formals->cell[i]);
+				if (i != v->formals->count - 1)
+				{
+					putchar(' ');
+				}
+			}
+			printf("} ");
 			lval_print(e, v->body);
 			putchar(')');
 		}
@@ -507,14 +1059,20 @@ lval *lval_pop(lval *v, int i)
 	/* Find the item at i */
 	lval *x = v->cell[i];
 
+	/* The first item is popped by moving the start of the list past it */
+	if (i == 0)
+	{
+		v->cell++;
+		v->front++;
+		v->count--;
+		return x;
+	}
+
 	/* Shift the memory after the item at i over the top */
 	memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval *) * (v->count - i - 1));
 
-	/* Decrease the count of items in the list */
-	v->count--;
-
-	/* Reallocate the memory used */
-	v->cell = realloc(v->cell, sizeof(lval *) * v->count);
+	/* Decrease the count of items in the list and reallocate the memory used */
+	lval_resize(v, v->count - 1);
 	return x;
 }
 
@@ -525,6 +1083,16 @@ lval *lval_take(lval *v, int i)
 	return x;
 }
 
+/* Delete the list v, which we own, after its values have all been taken by the caller */
+void lval_drop(lval *v)
+{
+	cells_free(v->cell - v->front, v->front + v->count);
+	v->cell = NULL;
+	v->count = 0;
+	v->front = 0;
+	lval_del(v);
+}
+
 lval *builtin_head(lenv *e, lval *a)
 {
 	/* Check error conditions */
@@ -535,13 +1103,10 @@ lval *builtin_head(lenv *e, lval *a)
 	/* Otherwise take first argument */
 	lval *v = lval_take(a, 0);
 
-	/* Delete all elements that are not head and return */
-	while (v->count > 1)
-	{
-		lval_del(lval_pop(v, 1));
-	}
-
-	return v;
+	/* Share the head in a new list and delete the rest */
+	lval *x = lval_add(lval_qexpr(), lval_copy(v->cell[0]));
+	lval_del(v);
+	return x;
 }
 
 lval *builtin_tail(lenv *e, lval *a)
@@ -554,6 +1119,18 @@ lval *builtin_tail(lenv *e, lval *a)
 	/* Otherwise take first argument */
 	lval *v = lval_take(a, 0);
 
+	/* A list held elsewhere is sliced rather than copied, so recursing down it is linear */
+	if (v->refs > 1 || LVAL_IS_FROZEN(v) || LVAL_IS_SLICE(v))
+	{
+		lval *x = lval_qexpr();
+		x->flags |= LVAL_SLICE;
+		x->count = v->count - 1;
+		x->cell = v->cell + 1;
+		x->base = lval_copy(LVAL_IS_SLICE(v) ? v->base : v);
+		lval_del(v);
+		return x;
+	}
+
 	/* Delete first element and return */
 	lval_del(lval_pop(v, 0));
 	return v;
@@ -570,20 +1147,34 @@ lval *builtin_eval(lenv *e, lval *a)
 	LASSERT_NUM_ARGS(a, 1, "eval");
 	LASSERT_TYPE(a, 0, LVAL_QEXPR, "eval");
 
-	lval *x = lval_take(a, 0);
+	lval *x = lval_unshare(lval_take(a, 0));
 	x->type = LVAL_SEXPR;
 	return lval_eval(e, x);
 }
 
 lval *lval_join(lval *x, lval *y)
 {
-	/* For each cell in y add it to x */
-	while (y->count)
+	/* Move a shorter x to the front of a y we own, as when a list is built up from its end */
+	if (y->refs == 1 && !LVAL_IS_FROZEN(y) && !LVAL_IS_SLICE(y) && x->count < y->count)
+	{
+		y = lval_unshare(y);
+		y->type = x->type;
+		lval_grow_front(y, x->count);
+		if (x->count)
+		{
+			memcpy(y->cell, x->cell, sizeof(lval *) * x->count);
+		}
+		lval_drop(x);
+		return y;
+	}
+
+	/* For each cell in y add a share of it to x */
+	for (int i = 0; i < y->count; i++)
 	{
-		x = lval_add(x, lval_pop(y, 0));
+		x = lval_add(x, lval_copy(y->cell[i]));
 	}
 
-	/* Delete the empty y and return x */
+	/* Release y and return x */
 	lval_del(y);
 	return x;
 }
@@ -595,7 +1186,7 @@ lval *builtin_join(lenv *e, lval *a)
 		LASSERT_TYPE(a, i, LVAL_QEXPR, "join");
 	}
 
-	lval *x = lval_pop(a, 0);
+	lval *x = lval_unshare(lval_pop(a, 0));
 
 	while (a->count)
 	{
@@ -611,20 +1202,10 @@ lval *builtin_cons(lenv *e, lval *a)
 	LASSERT_NUM_ARGS(a, 2, "cons");
 	LASSERT_TYPE(a, 1, LVAL_QEXPR, "cons");
 	lval *v = lval_pop(a, 0);
-	lval *q = lval_take(a, 0);
-
-	/* Reallocate the memory used */
-	q->cell = realloc(q->cell, sizeof(lval *) * (q->count + 1));
-	/* Shift the memory up one */
-	if (q->count)
-	{
-		memmove(&q->cell[1], &q->cell[0], sizeof(lval *) * q->count);
-	}
-
-	/* Increase the count of items in the list */
-	q->count++;
+	lval *q = lval_unshare(lval_take(a, 0));
 
 	/* Prepend value */
+	lval_grow_front(q, 1);
 	q->cell[0] = v;
 	return q;
 }
@@ -634,8 +1215,10 @@ lval *builtin_len(lenv *e, lval *a)
 	LASSERT_NUM_ARGS(a, 1, "len");
 	LASSERT_TYPE(a, 0, LVAL_QEXPR, "len");
 	lval *q = lval_take(a, 0);
+	lval *n = lval_num(q->count);
 
-	return lval_num(q->count);
+	lval_del(q);
+	return n;
 }
 
 lval *builtin_init(lenv *e, lval *a)
@@ -643,12 +1226,10 @@ lval *builtin_init(lenv *e, lval *a)
 	LASSERT_NUM_ARGS(a, 1, "init");
 	LASSERT_TYPE(a, 0, LVAL_QEXPR, "init");
 	LASSERT_NOT_EMPTY_LIST(a, "init");
-	lval *q = lval_take(a, 0);
+	lval *q = lval_unshare(lval_take(a, 0));
 
 	/* Decrease the count of items in the list */
-	q->count--;
-	/* Reallocate the memory used */
-	q->cell = realloc(q->cell, sizeof(lval *) * (q->count));
+	lval_resize(q, q->count - 1);
 
 	return q;
 }
@@ -658,60 +1239,56 @@ lval *builtin_op(lenv *e, lval *a, char *op)
 	/* Ensure all arguments are numbers */
 	for (int i = 0; i < a->count; i++)
 	{
-		LASSERT(a->cell[i], a->cell[i]->type == LVAL_NUM, "Cannot perform operation. Expected Number argument at position %i, got %s.", i, ltype_name(a->cell[i]->type));
+		LASSERT(a, LTYPE(a->cell[i]) == LVAL_NUM, "Cannot perform operation. Expected Number argument at position %i, got %s.", i, ltype_name(LTYPE(a->cell[i])));
 	}
 
-	/* Pop the first element */
-	lval *x = lval_pop(a, 0);
+	/* Start from the first element */
+	long x = LNUM(a->cell[0]);
 
 	/* If no arguments and sub then perform unary negation */
-	if ((strcmp(op, "-") == 0) && a->count == 0)
+	if ((strcmp(op, "-") == 0) && a->count == 1)
 	{
-		x->num = -x->num;
+		x = -x;
 	}
 
-	/* While there are still elements remaining */
-	while (a->count > 0)
+	/* Fold in the remaining elements */
+	for (int i = 1; i < a->count; i++)
 	{
-		/* Pop the next element */
-		lval *y = lval_pop(a, 0);
+		long y = LNUM(a->cell[i]);
 
 		if (strcmp(op, "+") == 0)
 		{
-			x->num += y->num;
+			x += y;
 		}
 		if (strcmp(op, "-") == 0)
 		{
-			x->num -= y->num;
+			x -= y;
 		}
 		if (strcmp(op, "*") == 0)
 		{
-			x->num *= y->num;
+			x *= y;
 		}
 		if (strcmp(op, "/") == 0)
 		{
-			if (y->num == 0)
+			if (y == 0)
 			{
-				lval_del(x);
-				lval_del(y);
+				lval_del(a);
 				return lval_err("Division by zero.");
 			}
-			x->num /= y->num;
+			x /= y;
 		}
 		if (strcmp(op, "%") == 0)
 		{
-			x->num %= y->num;
+			x %= y;
 		}
 		if (strcmp(op, "^") == 0)
 		{
-			x->num ^= y->num;
+			x ^= y;
 		}
-
-		lval_del(y);
 	}
 
 	lval_del(a);
-	return x;
+	return lval_num(x);
 }
 
 lval *builtin_add(lenv *e, lval *a)
@@ -744,607 +1321,4456 @@ lval *builtin_xor(lenv *e, lval *a)
 	return builtin_op(e, a, "^");
 }
 
-lval *builtin_lambda(lenv *e, lval *a)
+/* Whether binding the i-th of formals takes a new frame slot, which '&' and repeated names do not */
+int formal_takes_slot(lval *formals, int i)
 {
-	LASSERT_NUM_ARGS(a, 2, "\\");
-	LASSERT_TYPE(a, 0, LVAL_QEXPR, "\\");
-	LASSERT_TYPE(a, 1, LVAL_QEXPR, "\\");
-
-	for (int i = 0; i < a->cell[0]->count; ++i)
+	char *f = formals->cell[i]->sym;
+	if (f == sym_varargs)
 	{
-		LASSERT(a, (a->cell[0]->cell[i]->type == LVAL_SYM), "Cannot define non-symbol. Got %s.", ltype_name(a->cell[0]->cell[i]->type));
+		return 0;
 	}
-
-	lval *formals = lval_pop(a, 0);
-	lval *body = lval_pop(a, 0);
-	lval_del(a);
-
-	return lval_lambda(formals, body);
+	for (int j = 0; j < i; j++)
+	{
+		if (formals->cell[j]->sym == f)
+		{
+			return 0;
+		}
+	}
+	return 1;
 }
 
-lval *lval_eval_sexpr(lenv *e, lval *v)
+/* Slot a frame binds sym to when called with formals, or -1 if sym is not a formal */
+int formal_slot(lval *formals, char *sym)
 {
-	/* Evaluate children */
-	for (int i = 0; i < v->count; i++)
+	int slot = 0;
+	for (int i = 0; i < formals->count; i++)
 	{
-		v->cell[i] = lval_eval(e, v->cell[i]);
+		if (formals->cell[i]->sym == sym && sym != sym_varargs)
+		{
+			return slot;
+		}
+		slot += formal_takes_slot(formals, i);
 	}
+	return -1;
+}
 
-	/* Error checking */
-	for (int i = 0; i < v->count; i++)
+/* Whether '&' appears in formals only as the last but one, followed by the symbol for the rest */
+int formals_valid(lval *formals)
+{
+	for (int i = 0; i < formals->count; i++)
 	{
-		if (v->cell[i]->type == LVAL_ERR)
+		if (formals->cell[i]->sym == sym_varargs && i != formals->count - 2)
 		{
-			return lval_take(v, i);
+			return 0;
 		}
 	}
+	return 1;
+}
 
-	/* Empty expression */
-	if (v->count == 0)
+/* Number of slots a frame needs to bind formals */
+int formal_slots(lval *formals)
+{
+	int n = 0;
+	for (int i = 0; i < formals->count; i++)
 	{
-		return v;
+		n += formal_takes_slot(formals, i);
 	}
-	/* Single expression, except exit and deflist*/
-	int is_exit = (v->cell[0]->builtin == lenv_get(e, lval_sym("exit"))->builtin);
-	int is_deflist = (v->cell[0]->builtin == lenv_get(e, lval_sym("deflist"))->builtin);
-	if (v->count == 1 && !is_exit & !is_deflist)
+	return n;
+}
+
+/*
+ * Return v with every symbol that names one of formals marked with the slot it
+ * will be bound to in the function's frame, taking ownership of v. Parts of v
+ * that need no change stay shared. The slot is only a hint checked on lookup,
+ * as dynamic scope means a nested Q-Expression may be evaluated anywhere.
+ */
+lval *lval_resolve(lval *v, lval *formals)
+{
+	switch (LTYPE(v))
+	{
+	case LVAL_SYM:
+	{
+		int slot = formal_slot(formals, v->sym);
+		if (slot < 0 || slot == v->slot)
+		{
+			return v;
+		}
+
+		lval *x = lval_unshare(v);
+		x->slot = slot;
+		return x;
+	}
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+		for (int i = 0; i < v->count; i++)
+		{
+			lval *x = lval_resolve(lval_copy(v->cell[i]), formals);
+			if (x == v->cell[i])
+			{
+				lval_del(x);
+				continue;
+			}
+
+			/* Only copy v once something in it has changed */
+			v = lval_unshare(v);
+			lval_del(v->cell[i]);
+			v->cell[i] = x;
+		}
+		return v;
+	default:
+		return v;
+	}
+}
+
+/* Freeze the list v and every list within it, taking ownership of v and returning it frozen */
+lval *lval_freeze(lval *v)
+{
+	if ((LTYPE(v) != LVAL_SEXPR && LTYPE(v) != LVAL_QEXPR) || LVAL_IS_FROZEN(v))
+	{
+		return v;
+	}
+
+	/* Slices are copied, as a frozen list needs the field they keep their base in for its code */
+	if (LVAL_IS_SLICE(v))
+	{
+		v = lval_unshare(v);
+	}
+
+	v->flags |= LVAL_FROZEN;
+	for (int i = 0; i < v->count; i++)
+	{
+		v->cell[i] = lval_freeze(v->cell[i]);
+	}
+	return v;
+}
+
+lval *builtin_lambda(lenv *e, lval *a)
+{
+	LASSERT_NUM_ARGS(a, 2, "\\");
+	LASSERT_TYPE(a, 0, LVAL_QEXPR, "\\");
+	LASSERT_TYPE(a, 1, LVAL_QEXPR, "\\");
+
+	for (int i = 0; i < a->cell[0]->count; ++i)
+	{
+		LASSERT(a, (LTYPE(a->cell[0]->cell[i]) == LVAL_SYM), "Cannot define non-symbol. Got %s.", ltype_name(LTYPE(a->cell[0]->cell[i])));
+	}
+	LASSERT(a, formals_valid(a->cell[0]), "Function format invalid. Symbol '&' not followed by a single symbol.");
+
+	lval *formals = lval_pop(a, 0);
+	lval *body = lval_freeze(lval_resolve(lval_pop(a, 0), formals));
+	lval_del(a);
+
+	/* Reserve the frame's slots up front */
+	lval *f = lval_lambda(formals, body);
+	lenv_reserve(f->env, formal_slots(formals));
+	lval_close(f, e);
+	return f;
+}
+
+/* Return a lambda of no formals, made in e, whose body is the Q-Expression b, taking ownership of b */
+lval *lval_scope(lenv *e, lval *b)
+{
+	lval *f = lval_lambda(lval_qexpr(), lval_freeze(b));
+	lval_close(f, e);
+	return f;
+}
+
+/* S-Expressions are evaluated by the VM, which keeps its own stack rather than recursing */
+lval *lval_eval_sexpr(lenv *e, lval *v)
+{
+	return vm_eval_expr(e, v);
+}
+
+/* Whether x, alone in an S-Expression, is a builtin to call rather than a value to return */
+int lval_is_command(lval *x)
+{
+	if (LTYPE(x) != LVAL_FUN || !LVAL_IS_BUILTIN(x))
+	{
+		return 0;
+	}
+	return x->builtin == builtin_exit || x->builtin == builtin_deflist || x->builtin == builtin_memstats;
+}
+
+/* Finish evaluating the S-Expression v once all of its children have been evaluated */
+lval *lval_eval_call(lenv *e, lval *v)
+{
+	/* Error checking */
+	for (int i = 0; i < v->count; i++)
+	{
+		if (LTYPE(v->cell[i]) == LVAL_ERR)
+		{
+			return lval_take(v, i);
+		}
+	}
+
+	/* Empty expression */
+	if (v->count == 0)
+	{
+		return v;
+	}
+	/* Single expression, except exit, deflist and memstats */
+	if (v->count == 1 && !lval_is_command(v->cell[0]))
 	{
 		return lval_take(v, 0);
 	}
 
 	/* Ensure first element is a function after evaluation */
 	lval *f = lval_pop(v, 0);
-	if (f->type != LVAL_FUN)
+	if (LTYPE(f) != LVAL_FUN)
 	{
-		lval *err = lval_err("First element is not a function. Got %s.", ltype_name(f->type));
+		lval *err = lval_err("First element is not a function. Got %s.", ltype_name(LTYPE(f)));
 		lval_del(f);
 		lval_del(v);
 		return err;
 	}
 
 	/* If so call function to get result */
-	lval *result = lval_call(e, f, v);
-	lval_del(f);
-	return result;
+	return lval_call(e, f, v);
 }
 
+/* Frames with more bindings than this get a hash index, smaller ones are scanned */
+#define LENV_INDEX_MIN 8
+
+/*
+ * The environment holding the builtins and definitions, and a count bumped
+ * whenever a global binding changes or a symbol is bound anywhere else for the
+ * first time. Lookups cached while the count is unchanged still hold.
+ */
+lenv *lenv_global = NULL;
+unsigned long lenv_version = 1;
+
+/*
+ * Lambdas see the bindings of the environment they were made in rather than
+ * those of their caller, through a parent they own that holds copies of the
+ * ones they refer to. Global lookups then cost the same however deep the calls
+ * go. Cleared by --dynamic for scripts written for the dynamic scope Lispy
+ * started with, where parents are borrowed, set to the caller for the length
+ * of a call.
+ */
+int lenv_lexical = 1;
+
 struct lenv
 {
+	int refs;
 	lenv *parent;
 
+	/* Bindings in definition order */
 	int count;
+	int capacity;
 	char **syms;
 	lval **vals;
 
+	/* Open addressing index from interned name to binding, or NULL for small frames */
+	int index_size;
+	int *index;
+
 	int builtins_count;
 	char **builtins;
+
+	/* Number of the lambda's formals bound here so far */
+	int bound;
+
+	/* Under lexical scope, a share of the body of the lambda, which may bind more here with '=' */
+	lval *body;
+
+	/* Whether lval_collect has reached the environment */
+	int marked;
 };
 
+/*
+ * Every call binds its arguments in a fresh copy of the lambda's environment,
+ * which is released when the call returns unless something still holds it,
+ * such as a partial application returned from the call. Released environments
+ * are kept in a last in first out pool along with their binding arrays, so
+ * calls that don't escape reuse the frame the last one left rather than
+ * allocating one.
+ */
+lenv *lenv_pool = NULL;
+
+/* Largest number of bindings a pooled environment keeps room for */
+#define LENV_POOL_CAPACITY 16
+
+long lenv_live = 0;
+long lenv_recycled = 0;
+
 lenv *lenv_new(void)
 {
-	lenv *e = malloc(sizeof(lenv));
+	lenv *e = lenv_pool;
+	if (e)
+	{
+		lenv_pool = e->parent;
+		lenv_recycled++;
+	}
+	else
+	{
+		e = malloc(sizeof(lenv));
+		e->capacity = 0;
+		e->syms = NULL;
+		e->vals = NULL;
+	}
+	lenv_live++;
+
+	e->refs = 1;
 	e->parent = NULL;
 	e->count = 0;
-	e->syms = NULL;
-	e->vals = NULL;
+	e->index_size = 0;
+	e->index = NULL;
 	e->builtins_count = 0;
 	e->builtins = NULL;
+	e->bound = 0;
+	e->body = NULL;
+	e->marked = 0;
 	return e;
 }
 
+/* Make room for at least n bindings in e */
+void lenv_reserve(lenv *e, int n)
+{
+	if (n > e->capacity)
+	{
+		e->capacity = n;
+		e->vals = realloc(e->vals, sizeof(lval *) * e->capacity);
+		e->syms = realloc(e->syms, sizeof(char *) * e->capacity);
+	}
+}
+
 void lenv_del(lenv *e)
 {
+	/* Under lexical scope every copy of a lambda shares the bindings it captured */
+	if (--e->refs > 0)
+	{
+		return;
+	}
+
 	for (int i = 0; i < e->count; ++i)
 	{
-		free(e->syms[i]);
 		lval_del(e->vals[i]);
 	}
-	free(e->syms);
-	free(e->vals);
-	free(e);
+	if (lenv_lexical && e->parent && e->parent != lenv_global)
+	{
+		lenv_del(e->parent);
+	}
+	if (e->body)
+	{
+		lval_del(e->body);
+	}
+	free(e->index);
+	free(e->builtins);
+	lenv_live--;
+
+	/* Keep small frames, arrays and all, for the next call */
+	if (e->capacity > LENV_POOL_CAPACITY)
+	{
+		free(e->syms);
+		free(e->vals);
+		e->capacity = 0;
+		e->syms = NULL;
+		e->vals = NULL;
+	}
+	e->parent = lenv_pool;
+	lenv_pool = e;
 }
 
-lval *lenv_get(lenv *e, lval *k)
+
+/* Interned names are unique, so hash the pointer rather than the string */
+unsigned long lenv_hash(char *sym)
+{
+	return ((uintptr_t)sym >> 4) * 2654435761UL;
+}
+
+/* Rebuild the index of e with room for at least twice as many bindings as it has */
+void lenv_reindex(lenv *e)
+{
+	e->index_size = e->index_size ? e->index_size * 2 : 4 * LENV_INDEX_MIN;
+	free(e->index);
+	e->index = malloc(sizeof(int) * e->index_size);
+	for (int i = 0; i < e->index_size; i++)
+	{
+		e->index[i] = -1;
+	}
+
+	for (int i = 0; i < e->count; i++)
+	{
+		unsigned long j = lenv_hash(e->syms[i]) & (e->index_size - 1);
+		while (e->index[j] != -1)
+		{
+			j = (j + 1) & (e->index_size - 1);
+		}
+		e->index[j] = i;
+	}
+}
+
+/* Find the position of the binding for sym in e alone, or -1 */
+int lenv_find(lenv *e, char *sym)
 {
+	if (e->index)
+	{
+		unsigned long j = lenv_hash(sym) & (e->index_size - 1);
+		while (e->index[j] != -1)
+		{
+			if (e->syms[e->index[j]] == sym)
+			{
+				return e->index[j];
+			}
+			j = (j + 1) & (e->index_size - 1);
+		}
+		return -1;
+	}
+
 	for (int i = 0; i < e->count; ++i)
 	{
-		/* Check if the stored string matches the symbol string */
-		/* If it does, return a copy of the value */
-		if (strcmp(e->syms[i], k->sym) == 0)
+		/* Check if the stored name is the symbol's interned name */
+		if (e->syms[i] == sym)
 		{
-			return lval_copy(e->vals[i]);
+			return i;
 		}
 	}
+	return -1;
+}
+
+/* Return the value box b binds, looking through the box it holds until its frame binds it, or NULL if unbound */
+lval *lval_unbox(lval *b)
+{
+	while (b && LTYPE(b) == LVAL_BOX)
+	{
+		b = b->boxed;
+	}
+	return b;
+}
+
+/*
+ * Return the value k is bound to from e, or NULL if it is unbound. The value is
+ * borrowed: it stays owned by the binding, so is only good until the next
+ * change to the environment, and must be copied to be kept or modified.
+ */
+lval *lenv_lookup(lenv *e, lval *k)
+{
+	/*
+	 * A global found by this symbol before is still in the same binding if
+	 * nothing has been bound since, which under dynamic scope is all that could
+	 * hide it. New symbols start at version 0, which lenv_version never is.
+	 */
+	if (k->version == lenv_version)
+	{
+		return lenv_global->vals[k->global];
+	}
 
-	if (e->parent)
+	/* Search this frame and then each parent in turn */
+	for (; e; e = e->parent)
 	{
-		return lenv_get(e->parent, k);
+		int i = lenv_find(e, k->sym);
+		if (i >= 0 && LTYPE(e->vals[i]) == LVAL_BOX)
+		{
+			/* Only frames, never the global environment, hold boxes */
+			lval *x = lval_unbox(e->vals[i]);
+			if (x)
+			{
+				return x;
+			}
+		}
+		else if (i >= 0)
+		{
+			/* Remember globals no other frame can bind */
+			if (e == lenv_global && !LSYM(k->sym)->shadowed)
+			{
+				k->global = i;
+				k->version = lenv_version;
+			}
+			return e->vals[i];
+		}
 	}
 
-	return lval_err("Unbound symbol '%s'", k->sym);
+	return NULL;
 }
 
-void lenv_put(lenv *e, lval *k, lval *v)
+/* Return a share of the value k is bound to from e */
+lval *lenv_get(lenv *e, lval *k)
+{
+	lval *v = lenv_lookup(e, k);
+	return v ? lval_copy(v) : lval_err("Unbound symbol '%s'", k->sym);
+}
+
+/* Bind k to v in e, taking ownership of v */
+void lenv_put_move(lenv *e, lval *k, lval *v)
 {
+	if (e == lenv_global)
+	{
+		lenv_version++;
+	}
+	else if (!LSYM(k->sym)->shadowed)
+	{
+		LSYM(k->sym)->shadowed = 1;
+		lenv_version++;
+	}
+
 	/* Check if variable already exists */
-	for (int i = 0; i < e->count; ++i)
+	int i = lenv_find(e, k->sym);
+
+	/* A boxed binding is shared with lambdas made here, so bind the box instead */
+	if (i >= 0 && LTYPE(e->vals[i]) == LVAL_BOX)
 	{
-		/* If variable is found, delete it and replace */
-		if (strcmp(e->syms[i], k->sym) == 0)
+		lval *b = e->vals[i];
+		if (b->boxed)
 		{
-			lval_del(e->vals[i]);
-			e->vals[i] = lval_copy(v);
-			return;
+			lval_del(b->boxed);
 		}
+		b->boxed = v;
+		return;
 	}
 
-	/* If no existing entry is found, allocate space for new entry */
+	/* If variable is found, delete it and replace */
+	if (i >= 0)
+	{
+		lval_del(e->vals[i]);
+		e->vals[i] = v;
+		return;
+	}
+
+	/* If no existing entry is found, make space for new entry */
+	if (e->count == e->capacity)
+	{
+		e->capacity = e->capacity ? e->capacity * 2 : 4;
+		e->vals = realloc(e->vals, sizeof(lval *) * e->capacity);
+		e->syms = realloc(e->syms, sizeof(char *) * e->capacity);
+	}
+
+	/* Store the value and symbol name in the new location */
+	e->vals[e->count] = v;
+	e->syms[e->count] = k->sym;
 	e->count++;
-	e->vals = realloc(e->vals, sizeof(lval *) * e->count);
-	e->syms = realloc(e->syms, sizeof(char *) * e->count);
 
-	/* Copy contents of lval and symbol string into new location */
-	e->vals[e->count - 1] = lval_copy(v);
-	e->syms[e->count - 1] = malloc(strlen(k->sym) + 1);
-	strcpy(e->syms[e->count - 1], k->sym);
+	/* Keep the index at most half full */
+	if (e->index ? 2 * e->count > e->index_size : e->count > LENV_INDEX_MIN)
+	{
+		lenv_reindex(e);
+	}
+	else if (e->index)
+	{
+		unsigned long j = lenv_hash(k->sym) & (e->index_size - 1);
+		while (e->index[j] != -1)
+		{
+			j = (j + 1) & (e->index_size - 1);
+		}
+		e->index[j] = e->count - 1;
+	}
+}
+
+/* Bind k to a share of v in e */
+void lenv_put(lenv *e, lval *k, lval *v)
+{
+	lenv_put_move(e, k, lval_copy(v));
 }
 
 void lenv_put_builtin(lenv *e, lval *k)
 {
 	e->builtins_count++;
 	e->builtins = realloc(e->builtins, sizeof(char *) * e->builtins_count);
-	e->builtins[e->builtins_count - 1] = malloc(strlen(k->sym) + 1);
-	strcpy(e->builtins[e->builtins_count - 1], k->sym);
+	e->builtins[e->builtins_count - 1] = k->sym;
 }
 
 lenv *lenv_copy(lenv *e)
 {
-	lenv *n = malloc(sizeof(lenv));
+	lenv *n = lenv_new();
 
 	n->parent = e->parent;
+	if (lenv_lexical && n->parent && n->parent != lenv_global)
+	{
+		n->parent->refs++;
+	}
+
+	/* Keep the room reserved for the formals still to be bound */
+	lenv_reserve(n, e->capacity);
 	n->count = e->count;
-	n->syms = malloc(sizeof(char *) * n->count);
-	n->vals = malloc(sizeof(lval *) * n->count);
 	for (int i = 0; i < e->count; i++)
 	{
-		n->syms[i] = malloc(strlen(e->syms[i]) + 1);
-		strcpy(n->syms[i], e->syms[i]);
+		n->syms[i] = e->syms[i];
 		n->vals[i] = lval_copy(e->vals[i]);
 	}
-	n->builtins = e->builtins;
+	n->index_size = e->index_size;
+	n->index = NULL;
+	if (e->index)
+	{
+		n->index = malloc(sizeof(int) * n->index_size);
+		memcpy(n->index, e->index, sizeof(int) * n->index_size);
+	}
+	/* Each environment frees its own list of builtins */
 	n->builtins_count = e->builtins_count;
+	if (e->builtins)
+	{
+		n->builtins = malloc(sizeof(char *) * n->builtins_count);
+		memcpy(n->builtins, e->builtins, sizeof(char *) * n->builtins_count);
+	}
+	n->bound = e->bound;
+	n->body = e->body ? lval_copy(e->body) : NULL;
 
 	return n;
 }
 
+/* Bind k to v in the global environment reached from e, taking ownership of v */
 void lenv_def(lenv *e, lval *k, lval *v)
 {
 	while (e->parent)
 	{
 		e = e->parent;
 	}
-	lenv_put(e, k, v);
+	lenv_put_move(e, k, v);
 }
 
-lval *lval_eval(lenv *e, lval *v)
+/* Whether x is '=', by name or by the value it is bound to globally */
+int lval_is_put(lval *x)
 {
-	if (v->type == LVAL_SYM)
-	{
-		lval *x = lenv_get(e, v);
-		lval_del(v);
-		return x;
-	}
-	if (v->type == LVAL_SEXPR)
+	if (x->sym == sym_put)
 	{
-		return lval_eval_sexpr(e, v);
+		return 1;
 	}
-	return v;
+	int i = lenv_find(lenv_global, x->sym);
+	return i >= 0 && LTYPE(lenv_global->vals[i]) == LVAL_FUN && LVAL_IS_BUILTIN(lenv_global->vals[i]) && lenv_global->vals[i]->builtin == builtin_put;
 }
 
-lval *lval_call(lenv *e, lval *f, lval *a)
+/*
+ * Whether a call headed by h may be a call of '=', going by the values bound
+ * now. Only symbols bound globally and never anywhere else have a value known
+ * before the call runs, so any other head may turn out to be '='.
+ */
+int lval_may_put(lval *h)
 {
-	if (f->builtin)
+	if (LTYPE(h) == LVAL_SEXPR)
+	{
+		return 1;
+	}
+	if (LTYPE(h) != LVAL_SYM)
 	{
-		return f->builtin(e, a);
+		return 0;
 	}
+	return LSYM(h->sym)->shadowed || lenv_find(lenv_global, h->sym) < 0 || lval_is_put(h);
+}
 
-	int given = a->count;
-	int total = f->formals->count;
+/* Whether evaluating v may bind sym with '=', or bind anything if sym is NULL */
+int lval_assigns(lval *v, char *sym)
+{
+	switch (LTYPE(v))
+	{
+	/* '=' other than at the head of a form may be called with any names */
+	case LVAL_SYM:
+		return lval_is_put(v);
 
-	while (a->count)
+	/* Quoted code may be evaluated too, so look inside it as well */
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
 	{
-		if (f->formals->count == 0)
+		int i = 0;
+		if (v->count >= 2 && LTYPE(v->cell[1]) == LVAL_QEXPR && lval_may_put(v->cell[0]))
 		{
-			lval_del(a);
-			return lval_err("Function passed too many arguments. Got %i, expected %i.", given, total);
+			for (int j = 0; j < v->cell[1]->count; j++)
+			{
+				if (!sym || (LTYPE(v->cell[1]->cell[j]) == LVAL_SYM && v->cell[1]->cell[j]->sym == sym))
+				{
+					return 1;
+				}
+			}
+			i = 2;
 		}
-		lval *sym = lval_pop(f->formals, 0);
-
-		/* Special case to deal with '&' */
-		if (strcmp(sym->sym, "&") == 0)
+		for (; i < v->count; i++)
 		{
-			if (f->formals->count != 1)
+			if (lval_assigns(v->cell[i], sym))
 			{
-				lval_del(a);
-				return lval_err("Function format invalid. Symbol '&' not followed by a single symbol");
+				return 1;
 			}
-
-			/* Next formal should be bound to remaining arguments */
-			lval *nsym = lval_pop(f->formals, 0);
-			lenv_put(f->env, nsym, builtin_list(e, a));
-			lval_del(sym);
-			lval_del(nsym);
-			break;
 		}
-
-		lval *val = lval_pop(a, 0);
-		lenv_put(f->env, sym, val);
-		lval_del(sym);
-		lval_del(val);
+		return 0;
 	}
 
-	lval_del(a);
+	default:
+		return 0;
+	}
+}
 
-	/* If '&' remains in formal list bind to empty list */
-	if (f->formals->count > 0 && strcmp(f->formals->cell[0]->sym, "&") == 0)
+/* Whether the body of the lambda binding in e may bind sym there with '=', remembering for frozen bodies whether they use '=' at all */
+int lenv_assigns(lenv *e, char *sym)
+{
+	lval *b = e->body;
+	if (!b)
 	{
-		if (f->formals->count != 2)
-		{
-			return lval_err("Function format invalid. Symbol '&' not followed by a single symbol.");
-		}
-
-		/* Pop and delete '&' symbol */
-		lval_del(lval_pop(f->formals, 0));
-
-		/* Pop next symbol and create empty list */
-		lval *sym = lval_pop(f->formals, 0);
-		lval *val = lval_qexpr();
-
-		/* Bind to environment and delete */
-		lenv_put(f->env, sym, val);
-		lval_del(sym);
-		lval_del(val);
+		return 0;
 	}
-
-	if (f->formals->count == 0)
+	if (!LVAL_IS_FROZEN(b))
 	{
-		f->env->parent = e;
-		return builtin_eval(f->env, lval_add(lval_sexpr(), lval_copy(f->body)));
+		return lval_assigns(b, sym);
 	}
-
-	return lval_copy(f);
-}
-
-lval *builtin_var(lenv *e, lval *a, char *func)
-{
-	LASSERT_TYPE(a, 0, LVAL_QEXPR, func);
-
-	/* First argument is symbol list */
-	lval *syms = a->cell[0];
-
-	/* Ensure all elements of first list are symbols */
-	for (int i = 0; i < syms->count; ++i)
+	if (!LVAL_IS_SCANNED(b))
 	{
-		LASSERT(a, syms->cell[i]->type == LVAL_SYM, "Function '%s' cannot define non-symbol. Got %s.", func, ltype_name(syms->cell[i]->type));
+		b->flags |= LVAL_SCANNED | (lval_assigns(b, NULL) ? LVAL_ASSIGNS : 0);
 	}
+	return (b->flags & LVAL_ASSIGNS) && lval_assigns(b, sym);
+}
 
-	/* Ensure no elements are builtins */
-	for (int i = 0; i < syms->count; ++i)
+/*
+ * Return a share of what a lambda made in e captures for the symbol k, or NULL
+ * if k is only bound globally, where the lambda looks it up as it runs. Where a
+ * frame on the way may bind k again with '=', its binding is boxed in place, so
+ * that the frame and the lambda share it. If that frame has yet to bind k, it
+ * is given an unset box, holding what is seen of k from further out until the
+ * frame binds it.
+ */
+lval *lenv_box(lenv *e, lval *k)
+{
+	for (; e && e != lenv_global; e = e->parent)
 	{
-		for (int j = 0; j < e->builtins_count; ++j)
+		int i = lenv_find(e, k->sym);
+		int assigns = lenv_assigns(e, k->sym);
+		if (i < 0 && !assigns)
 		{
-			LASSERT(a, strcmp(syms->cell[i]->sym, e->builtins[j]) != 0, "Function '%s' cannot redefine builtin '%s'", func, e->builtins[j]);
+			continue;
+		}
+
+		if (i < 0)
+		{
+			lenv_put_move(e, k, lval_box(lenv_box(e->parent, k)));
+			i = e->count - 1;
+		}
+		else if (assigns && LTYPE(e->vals[i]) != LVAL_BOX)
+		{
+			e->vals[i] = lval_box(e->vals[i]);
+		}
+		return lval_copy(e->vals[i]);
+	}
+	return NULL;
+}
+
+/* Bind in c what the symbols of v not in formals find from e, see lenv_box */
+void lenv_capture(lenv *c, lenv *e, lval *v, lval *formals)
+{
+	switch (LTYPE(v))
+	{
+	case LVAL_SYM:
+		if (formal_slot(formals, v->sym) < 0 && lenv_find(c, v->sym) < 0)
+		{
+			lval *x = lenv_box(e, v);
+			if (x)
+			{
+				lenv_put_move(c, v, x);
+			}
+		}
+		break;
+
+	/* Quoted code may be evaluated too, so look inside it as well */
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+		for (int i = 0; i < v->count; i++)
+		{
+			lenv_capture(c, e, v->cell[i], formals);
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+/*
+ * Under lexical scope, give lambda f, made in e, the bindings of e its body
+ * refers to. They are copied into a flat environment of their own, which every
+ * copy of f shares, so a lambda keeps alive only what it captured rather than
+ * the frames it was made in. Symbols only bound globally when f is made are
+ * looked up when it runs, so it sees later definitions, and bindings a frame
+ * may still change with '=' are shared through boxes.
+ */
+void lval_close(lval *f, lenv *e)
+{
+	if (!lenv_lexical)
+	{
+		return;
+	}
+
+	/* Calls of f bind in copies of its environment, which need to know what its body binds */
+	f->env->body = lval_copy(f->body);
+
+	lenv *c = lenv_new();
+	c->parent = lenv_global;
+	lenv_capture(c, e, f->body, f->formals);
+	if (c->count == 0)
+	{
+		lenv_del(c);
+		c = lenv_global;
+	}
+	f->env->parent = c;
+}
+
+/* Look up a share of the value of symbol k in e, leaving k to the caller */
+lval *lval_eval_sym(lenv *e, lval *k)
+{
+	/* Formals are found in their slot without searching, unless a lambda made here boxed them */
+	if (k->slot < e->count && e->syms[k->slot] == k->sym && LTYPE(e->vals[k->slot]) != LVAL_BOX)
+	{
+		return lval_copy(e->vals[k->slot]);
+	}
+	return lenv_get(e, k);
+}
+
+lval *lval_eval(lenv *e, lval *v)
+{
+	if (LTYPE(v) == LVAL_SYM)
+	{
+		lval *x = lval_eval_sym(e, v);
+		lval_del(v);
+		return x;
+	}
+	if (LTYPE(v) == LVAL_SEXPR)
+	{
+		return lval_eval_sexpr(e, v);
+	}
+	return v;
+}
+
+/* Number of the formals of lambda f that are still to be bound */
+int lval_unbound(lval *f)
+{
+	return f->formals->count - f->env->bound;
+}
+
+/*
+ * Bind arguments a to the next formals of lambda f, taking ownership of both.
+ * Returns f, which is ready to run once it has no formals left, or an error.
+ * The formals themselves are shared by every application of the lambda, and
+ * the environment of a partial application holds just the arguments given.
+ */
+lval *lval_bind(lval *f, lval *a)
+{
+	/* Binding arguments fills the environment */
+	f = lval_unshare(f);
+
+	lval *formals = f->formals;
+	int bound = f->env->bound;
+	int fixed = formals->count - (LVAL_IS_VARIADIC(f) ? 2 : 0);
+	int given = a->count;
+
+	if (!LVAL_IS_VARIADIC(f) && bound + given > fixed)
+	{
+		lval_del(f);
+		lval_del(a);
+		return lval_err("Function passed too many arguments. Got %i, expected %i.", given, formals->count - bound);
+	}
+
+	/* Formals before '&' take an argument each */
+	int n = given < fixed - bound ? given : fixed - bound;
+	for (int i = 0; i < n; i++)
+	{
+		lenv_put_move(f->env, formals->cell[bound + i], a->cell[i]);
+	}
+	f->env->bound += n;
+
+	/* Once they are all bound, the symbol after '&' is bound to a list of the rest */
+	if (LVAL_IS_VARIADIC(f) && f->env->bound == fixed)
+	{
+		a->cell += n;
+		a->front += n;
+		a->count = given - n;
+		a->type = LVAL_QEXPR;
+		lenv_put_move(f->env, formals->cell[fixed + 1], a);
+		f->env->bound = formals->count;
+		return f;
+	}
+
+	lval_drop(a);
+	return f;
+}
+
+/* Call f with arguments a, taking ownership of both */
+lval *lval_call(lenv *e, lval *f, lval *a)
+{
+	if (LVAL_IS_BUILTIN(f))
+	{
+		lval *result = f->builtin(e, a);
+		lval_del(f);
+		return result;
+	}
+
+	lval *r = lval_call_aot(f, a->cell, a->count);
+	if (r)
+	{
+		lval_del(f);
+		lval_del(a);
+		return r;
+	}
+
+	f = lval_bind(f, a);
+	if (LTYPE(f) == LVAL_FUN && lval_unbound(f) == 0)
+	{
+		return lval_run(e, f);
+	}
+
+	/* Otherwise return the error or partially applied function */
+	return f;
+}
+
+/* Run the body of lambda f, which has all of its formals bound, as called from e */
+lval *lval_run(lenv *e, lval *f)
+{
+	if (!lenv_lexical)
+	{
+		f->env->parent = e;
+	}
+	return vm_run(f->env, lval_code(f->body), f);
+}
+
+
+/* Whether none of the arguments of the S-Expression v, whose children have been evaluated, is an error */
+int lval_args_ok(lval *v)
+{
+	for (int i = 1; i < v->count; i++)
+	{
+		if (LTYPE(v->cell[i]) == LVAL_ERR)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Whether the S-Expression v, whose children have been evaluated, calls a lambda */
+int lval_is_lambda_call(lval *v)
+{
+	if (v->count < 2 || LTYPE(v->cell[0]) != LVAL_FUN || LVAL_IS_BUILTIN(v->cell[0]))
+	{
+		return 0;
+	}
+	return lval_args_ok(v);
+}
+
+/*
+ * If the S-Expression v, whose children have been evaluated, is a call of 'eval'
+ * or 'if' that would succeed, return the S-Expression it goes on to evaluate and
+ * delete v. Otherwise return NULL and leave v alone. The VM evaluates these
+ * itself so that they need no native stack.
+ */
+lval *lval_tail_expr(lval *v)
+{
+	if (v->count < 2 || LTYPE(v->cell[0]) != LVAL_FUN || !LVAL_IS_BUILTIN(v->cell[0]) || !lval_args_ok(v))
+	{
+		return NULL;
+	}
+
+	int i;
+	lbuiltin b = v->cell[0]->builtin;
+	if (b == builtin_eval && v->count == 2 && LTYPE(v->cell[1]) == LVAL_QEXPR)
+	{
+		i = 1;
+	}
+	else if (b == builtin_if && v->count == 4 && LTYPE(v->cell[1]) == LVAL_NUM && LTYPE(v->cell[2]) == LVAL_QEXPR && LTYPE(v->cell[3]) == LVAL_QEXPR)
+	{
+		i = LNUM(v->cell[1]) ? 2 : 3;
+	}
+	else
+	{
+		return NULL;
+	}
+
+	/* A frozen list runs as it is, as though it were a function body */
+	lval *x = lval_take(v, i);
+	if (LVAL_IS_FROZEN(x))
+	{
+		return x;
+	}
+	x = lval_unshare(x);
+	x->type = LVAL_SEXPR;
+	return x;
+}
+
+/* Apply the single expression rule to x, the value of the only child of an S-Expression evaluated in e */
+lval *lval_eval_single(lenv *e, lval *x)
+{
+	return lval_eval_call(e, lval_add(lval_sexpr(), x));
+}
+
+/*
+ * Apply the S-Expression v, whose children have been evaluated, as far as can be
+ * done without evaluating anything more, and return the result. A call of 'eval',
+ * 'if', 'select' or 'case' instead returns the S-Expression it goes on to
+ * evaluate through x, and
+ * a call of a lambda returns the lambda ready to run through f, with NULL
+ * returned in either case.
+ */
+lval *lval_apply(lenv *e, lval *v, lval **f, lval **x)
+{
+	*f = NULL;
+	if ((*x = lval_tail_expr(v)))
+	{
+		return NULL;
+	}
+
+	/* 'let' runs its body in a frame of its own, like the body of a lambda */
+	if (v->count == 2 && LTYPE(v->cell[0]) == LVAL_FUN && LVAL_IS_BUILTIN(v->cell[0]) && v->cell[0]->builtin == builtin_let && LTYPE(v->cell[1]) == LVAL_QEXPR)
+	{
+		*f = lval_scope(e, lval_take(v, 1));
+		return NULL;
+	}
+
+	/* 'select' and 'case' evaluate the body they choose in place of the call, as 'if' does */
+	if (v->count >= 2 && LTYPE(v->cell[0]) == LVAL_FUN && LVAL_IS_BUILTIN(v->cell[0]) &&
+		(v->cell[0]->builtin == builtin_select || v->cell[0]->builtin == builtin_case) && lval_args_ok(v))
+	{
+		int keyed = v->cell[0]->builtin == builtin_case;
+		lval_del(lval_pop(v, 0));
+		lval *y = lval_clause(e, v, keyed);
+		if (LTYPE(y) == LVAL_SYM)
+		{
+			y = lval_add(lval_sexpr(), y);
+		}
+		if (LTYPE(y) != LVAL_SEXPR)
+		{
+			return y;
+		}
+		*x = LVAL_IS_FROZEN(y) ? y : lval_unshare(y);
+		return NULL;
+	}
+
+	if (!lval_is_lambda_call(v))
+	{
+		return lval_eval_call(e, v);
+	}
+
+	lval *r = lval_call_aot(v->cell[0], v->cell + 1, v->count - 1);
+	if (r)
+	{
+		lval_del(v);
+		return r;
+	}
+
+	lval *g = lval_bind(lval_pop(v, 0), v);
+	if (LTYPE(g) != LVAL_FUN || lval_unbound(g) > 0)
+	{
+		return g;
+	}
+	*f = g;
+	return NULL;
+}
+
+/* Bytecode */
+
+/*
+ * Function bodies are compiled to bytecode for a small stack machine the first
+ * time they are called, and the code is kept with the body. Each opcode is
+ * followed by its operands in the same array.
+ */
+enum opcode
+{
+	/* k: Push constant k */
+	OP_CONST,
+	/* k: Push the value of symbol constant k */
+	OP_LOAD,
+	/* n: Pop n values and evaluate them as an S-Expression */
+	OP_CALL,
+	/* n: Like OP_CALL but return the result, running a lambda in place of the current one */
+	OP_TAIL_CALL,
+	/* k, addr: Pop the top value if it is the builtin constant k, otherwise jump to addr */
+	OP_GUARD,
+	/* k, alt, end: Pop the condition of the function named by symbol constant k, jump to alt if it is 0 or push an error and jump to end if it is not a Number */
+	OP_BRANCH,
+	/* t, end: Pop the value of a 'case' and jump to the clause for it in table t, or push an error and jump to end if there is none */
+	OP_SWITCH,
+	/* addr: Jump to addr */
+	OP_JUMP,
+	/* addr: Pop the top value, unless it is an error, in which case jump to addr leaving it */
+	OP_DROP,
+	/* k: Push a new lambda with the formals constant k and the body constant k + 1 */
+	OP_LAMBDA,
+	/* Return the top value */
+	OP_RETURN
+};
+
+/* Where a 'case' compiled by lcode_compile_case goes for each of its keys */
+struct lswitch
+{
+	/* Positions of the clauses for the Numbers from min to min + span - 1, when all the keys are such Numbers */
+	long min;
+	unsigned long span;
+	int *dense;
+
+	/* Otherwise the keys, open addressed, and the positions of their clauses */
+	int size;
+	lval **keys;
+	int *addrs;
+};
+
+struct lcode
+{
+	int count;
+	int capacity;
+	int *ops;
+
+	/* Values the code refers to, owned by the code */
+	int consts_count;
+	lval **consts;
+
+	/* Tables of the 'case' forms in the code */
+	int switches_count;
+	struct lswitch *switches;
+
+	/* Stack depth reached while compiling, and the most values the code needs on the stack */
+	int depth;
+	int max_depth;
+
+	/* The opcodes compiled to the handlers that run them, at the same positions as in ops */
+	struct vm_insn *insns;
+
+	/* Times the code has run as a function body, and the machine code compiled from it once hot */
+	int calls;
+	ljit_fn native;
+	unsigned char *native_mem;
+	size_t native_size;
+
+	/* C the body was compiled to with --emit-c, taking aot_arity Numbers */
+	laot_fn aot;
+	int aot_arity;
+};
+
+/* Handler running an opcode, see lcode_thread */
+typedef int (*vm_handler)(struct vm_insn *in);
+
+/* An opcode decoded for its handler */
+struct vm_insn
+{
+	vm_handler run;
+
+	/* Position of the opcode and of the next one, and where it may jump to instead */
+	int pc;
+	int next;
+	int alt;
+	int end;
+
+	/* Constants the opcode uses, and the number of values a call takes */
+	lval *k;
+	lval *body;
+	int n;
+
+	/* For a call of two arguments, the builtin it made the first time, which is done inline */
+	lbuiltin fn;
+
+	/* Table a 'case' jumps through */
+	struct lswitch *sw;
+
+	/* Value a load found, valid while lenv_version is unchanged, and owned by the code */
+	lval *cache;
+	unsigned long version;
+};
+
+/* Hash of v that values equal under lval_eq share */
+unsigned long lval_hash(lval *v)
+{
+	unsigned long h = LTYPE(v);
+	switch (LTYPE(v))
+	{
+	case LVAL_NUM:
+		return (unsigned long)LNUM(v) * 2654435761UL;
+	case LVAL_STR:
+		return intern_hash(v->str);
+	case LVAL_SYM:
+		return lenv_hash(v->sym);
+	case LVAL_QEXPR:
+	case LVAL_SEXPR:
+		for (int i = 0; i < v->count; i++)
+		{
+			h = (h ^ lval_hash(v->cell[i])) * 16777619UL;
+		}
+		return h;
+	default:
+		return h;
+	}
+}
+
+/* Number keys go in a dense table when their range is less than this many times their count */
+#define LSWITCH_SPREAD 4
+
+/* Fill s from the n keys and the positions of their clauses, the first clause for a key taking it */
+void lswitch_init(struct lswitch *s, lval **keys, int *addrs, int n)
+{
+	memset(s, 0, sizeof(*s));
+
+	int numbers = n > 0;
+	long min = 0;
+	long max = 0;
+	for (int i = 0; i < n; i++)
+	{
+		if (LTYPE(keys[i]) != LVAL_NUM)
+		{
+			numbers = 0;
+			break;
+		}
+		long x = LNUM(keys[i]);
+		min = i == 0 || x < min ? x : min;
+		max = i == 0 || x > max ? x : max;
+	}
+
+	if (numbers && (unsigned long)max - (unsigned long)min < (unsigned long)n * LSWITCH_SPREAD)
+	{
+		s->min = min;
+		s->span = (unsigned long)max - (unsigned long)min + 1;
+		s->dense = malloc(sizeof(int) * s->span);
+		for (unsigned long i = 0; i < s->span; i++)
+		{
+			s->dense[i] = -1;
+		}
+		for (int i = n - 1; i >= 0; i--)
+		{
+			s->dense[(unsigned long)LNUM(keys[i]) - (unsigned long)min] = addrs[i];
+		}
+		return;
+	}
+
+	/* Keep the table at most half full */
+	s->size = 4;
+	while (s->size < 2 * n)
+	{
+		s->size *= 2;
+	}
+	s->keys = calloc(s->size, sizeof(lval *));
+	s->addrs = malloc(sizeof(int) * s->size);
+	for (int i = 0; i < n; i++)
+	{
+		unsigned long j = lval_hash(keys[i]) & (s->size - 1);
+		while (s->keys[j] && !lval_eq(s->keys[j], keys[i]))
+		{
+			j = (j + 1) & (s->size - 1);
+		}
+		if (!s->keys[j])
+		{
+			s->keys[j] = lval_copy(keys[i]);
+			s->addrs[j] = addrs[i];
+		}
+	}
+}
+
+/* Position of the clause of s for the value x, or -1 */
+int lswitch_find(struct lswitch *s, lval *x)
+{
+	if (s->dense)
+	{
+		if (LTYPE(x) != LVAL_NUM)
+		{
+			return -1;
+		}
+		unsigned long i = (unsigned long)LNUM(x) - (unsigned long)s->min;
+		return i < s->span ? s->dense[i] : -1;
+	}
+
+	for (unsigned long j = lval_hash(x) & (s->size - 1); s->keys[j]; j = (j + 1) & (s->size - 1))
+	{
+		if (lval_eq(s->keys[j], x))
+		{
+			return s->addrs[j];
+		}
+	}
+	return -1;
+}
+
+void lswitch_free(struct lswitch *s)
+{
+	for (int i = 0; i < s->size; i++)
+	{
+		if (s->keys[i])
+		{
+			lval_del(s->keys[i]);
+		}
+	}
+	free(s->keys);
+	free(s->addrs);
+	free(s->dense);
+}
+
+lcode *lcode_new(void)
+{
+	return calloc(1, sizeof(lcode));
+}
+
+void lcode_del(lcode *c)
+{
+	for (int i = 0; i < c->consts_count; i++)
+	{
+		lval_del(c->consts[i]);
+	}
+	free(c->consts);
+	for (int i = 0; i < c->switches_count; i++)
+	{
+		lswitch_free(&c->switches[i]);
+	}
+	free(c->switches);
+	free(c->ops);
+	for (int i = 0; i < c->count; i++)
+	{
+		if (c->insns[i].cache)
+		{
+			lval_del(c->insns[i].cache);
+		}
+	}
+	free(c->insns);
+#if LJIT
+	if (c->native_mem)
+	{
+		munmap(c->native_mem, c->native_size);
+	}
+#endif
+	free(c);
+}
+
+/* Append op to the code and return its position */
+int lcode_emit(lcode *c, int op)
+{
+	if (c->count == c->capacity)
+	{
+		c->capacity = c->capacity ? c->capacity * 2 : 16;
+		c->ops = realloc(c->ops, sizeof(int) * c->capacity);
+	}
+	c->ops[c->count] = op;
+	return c->count++;
+}
+
+/* Add v to the constants of the code, taking ownership of it, and return its index */
+int lcode_const(lcode *c, lval *v)
+{
+	c->consts = realloc(c->consts, sizeof(lval *) * (c->consts_count + 1));
+	c->consts[c->consts_count] = v;
+	return c->consts_count++;
+}
+
+/* Record that the code emitted last changes the stack depth by n */
+void lcode_stack(lcode *c, int n)
+{
+	c->depth += n;
+	if (c->depth > c->max_depth)
+	{
+		c->max_depth = c->depth;
+	}
+}
+
+void lcode_compile_sexpr(lcode *c, lval *v, int tail);
+
+/* Compile code pushing the value of v */
+void lcode_compile_expr(lcode *c, lval *v)
+{
+	switch (LTYPE(v))
+	{
+	case LVAL_SYM:
+		lcode_emit(c, OP_LOAD);
+		lcode_emit(c, lcode_const(c, lval_copy(v)));
+		lcode_stack(c, 1);
+		break;
+	case LVAL_SEXPR:
+		lcode_compile_sexpr(c, v, 0);
+		break;
+	default:
+		/* Everything else evaluates to itself */
+		lcode_emit(c, OP_CONST);
+		lcode_emit(c, lcode_const(c, lval_copy(v)));
+		lcode_stack(c, 1);
+		break;
+	}
+}
+
+/* Whether v is a call of the symbol named sym with n arguments, the last of which are Q-Expressions */
+int lcode_is_form(lval *v, char *sym, int n, int quoted)
+{
+	if (v->count != n + 1 || LTYPE(v->cell[0]) != LVAL_SYM || v->cell[0]->sym != sym)
+	{
+		return 0;
+	}
+	for (int i = n + 1 - quoted; i <= n; i++)
+	{
+		if (LTYPE(v->cell[i]) != LVAL_QEXPR)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Whether v calls the symbol named sym, or a global alias of the builtin b, with at least n arguments */
+int lcode_is_call(lval *v, char *sym, lbuiltin b, int n)
+{
+	if (v->count < n + 1 || LTYPE(v->cell[0]) != LVAL_SYM)
+	{
+		return 0;
+	}
+	if (v->cell[0]->sym == sym)
+	{
+		return 1;
+	}
+
+	/* The guard checks the value again when the code runs */
+	int i = lenv_global ? lenv_find(lenv_global, v->cell[0]->sym) : -1;
+	lval *x = i < 0 ? NULL : lenv_global->vals[i];
+	return x && LTYPE(x) == LVAL_FUN && LVAL_IS_BUILTIN(x) && x->builtin == b;
+}
+
+/*
+ * Compile (if c {a} {b}) to jump straight to the chosen branch. As 'if' can be
+ * rebound, a guard falls back to an ordinary call unless it is still the builtin.
+ */
+void lcode_compile_if(lcode *c, lval *v, int tail)
+{
+	int depth = c->depth;
+
+	lcode_compile_expr(c, v->cell[0]);
+	lcode_emit(c, OP_GUARD);
+	lcode_emit(c, lcode_const(c, lval_builtin(builtin_if)));
+	int generic = lcode_emit(c, 0);
+	lcode_stack(c, -1);
+
+	lcode_compile_expr(c, v->cell[1]);
+	lcode_emit(c, OP_BRANCH);
+	lcode_emit(c, lcode_const(c, lval_sym("if")));
+	int alt = lcode_emit(c, 0);
+	int failed = lcode_emit(c, 0);
+	lcode_stack(c, -1);
+
+	/* Each branch is evaluated as an S-Expression */
+	lcode_compile_sexpr(c, v->cell[2], tail);
+	lcode_emit(c, OP_JUMP);
+	int then_end = lcode_emit(c, 0);
+
+	c->ops[alt] = c->count;
+	c->depth = depth;
+	lcode_compile_sexpr(c, v->cell[3], tail);
+	lcode_emit(c, OP_JUMP);
+	int else_end = lcode_emit(c, 0);
+
+	/* The guard leaves the value of 'if' on the stack when it fails */
+	c->ops[generic] = c->count;
+	c->depth = depth + 1;
+	for (int i = 1; i < v->count; i++)
+	{
+		lcode_compile_expr(c, v->cell[i]);
+	}
+	lcode_emit(c, tail ? OP_TAIL_CALL : OP_CALL);
+	lcode_emit(c, v->count);
+	lcode_stack(c, 1 - v->count);
+
+	c->ops[failed] = c->ops[then_end] = c->ops[else_end] = c->count;
+}
+
+/*
+ * Compile (\ {formals} {body}) to make the lambda directly, resolving its body
+ * once here rather than every time it is made. Its code is then shared by every
+ * lambda made from it.
+ */
+void lcode_compile_lambda(lcode *c, lval *v)
+{
+	int depth = c->depth;
+
+	lcode_compile_expr(c, v->cell[0]);
+	lcode_emit(c, OP_GUARD);
+	lcode_emit(c, lcode_const(c, lval_builtin(builtin_lambda)));
+	int generic = lcode_emit(c, 0);
+	lcode_stack(c, -1);
+
+	lcode_emit(c, OP_LAMBDA);
+	int k = lcode_const(c, lval_copy(v->cell[1]));
+	lcode_const(c, lval_freeze(lval_resolve(lval_copy(v->cell[2]), v->cell[1])));
+	lcode_emit(c, k);
+	lcode_stack(c, 1);
+	lcode_emit(c, OP_JUMP);
+	int end = lcode_emit(c, 0);
+
+	c->ops[generic] = c->count;
+	c->depth = depth + 1;
+	for (int i = 1; i < v->count; i++)
+	{
+		lcode_compile_expr(c, v->cell[i]);
+	}
+	lcode_emit(c, OP_CALL);
+	lcode_emit(c, v->count);
+	lcode_stack(c, 1 - v->count);
+
+	c->ops[end] = c->count;
+}
+
+/* Compile code pushing the value of y evaluated as an S-Expression of its own, as 'eval' does {y} */
+void lcode_compile_item(lcode *c, lval *y, int tail)
+{
+	if (LTYPE(y) == LVAL_SEXPR)
+	{
+		lcode_compile_sexpr(c, y, tail);
+	}
+	else if (LTYPE(y) == LVAL_SYM)
+	{
+		lval *v = lval_add(lval_sexpr(), lval_copy(y));
+		lcode_compile_sexpr(c, v, tail);
+		lval_del(v);
+	}
+	else
+	{
+		lcode_compile_expr(c, y);
+	}
+}
+
+/* Whether v is a call of the symbol named sym whose arguments from first on are Q-Expressions of two values */
+int lcode_is_clauses(lval *v, char *sym, int first)
+{
+	if (v->count < 2 || LTYPE(v->cell[0]) != LVAL_SYM || v->cell[0]->sym != sym)
+	{
+		return 0;
+	}
+	for (int i = first; i < v->count; i++)
+	{
+		if (LTYPE(v->cell[i]) != LVAL_QEXPR || v->cell[i]->count != 2)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Compile code falling back to an ordinary call of v, whose function is on the stack at depth */
+void lcode_compile_generic(lcode *c, lval *v, int depth, int tail)
+{
+	c->depth = depth + 1;
+	for (int i = 1; i < v->count; i++)
+	{
+		lcode_compile_expr(c, v->cell[i]);
+	}
+	lcode_emit(c, tail ? OP_TAIL_CALL : OP_CALL);
+	lcode_emit(c, v->count);
+	lcode_stack(c, 1 - v->count);
+}
+
+/*
+ * Compile (do a ... z) to evaluate each argument in turn, going past the values
+ * of all but z, so that z is in tail position when the 'do' is. An error from an
+ * earlier argument becomes the value of the 'do' without evaluating the rest.
+ */
+void lcode_compile_do(lcode *c, lval *v, int tail)
+{
+	int depth = c->depth;
+
+	lcode_compile_expr(c, v->cell[0]);
+	lcode_emit(c, OP_GUARD);
+	lcode_emit(c, lcode_const(c, lval_builtin(builtin_do)));
+	int generic = lcode_emit(c, 0);
+	lcode_stack(c, -1);
+
+	int failed[v->count];
+	for (int i = 1; i < v->count - 1; i++)
+	{
+		lcode_compile_expr(c, v->cell[i]);
+		lcode_emit(c, OP_DROP);
+		failed[i] = lcode_emit(c, 0);
+		lcode_stack(c, -1);
+	}
+
+	lval *z = v->cell[v->count - 1];
+	if (LTYPE(z) == LVAL_SEXPR)
+	{
+		lcode_compile_sexpr(c, z, tail);
+	}
+	else
+	{
+		lcode_compile_expr(c, z);
+	}
+	lcode_emit(c, OP_JUMP);
+	int end = lcode_emit(c, 0);
+
+	c->ops[generic] = c->count;
+	lcode_compile_generic(c, v, depth, tail);
+
+	c->ops[end] = c->count;
+	for (int i = 1; i < v->count - 1; i++)
+	{
+		c->ops[failed[i]] = c->count;
+	}
+}
+
+/*
+ * Compile (select {c b} ...) to test each condition in turn like a chain of
+ * 'if', evaluating only the body of the first that holds.
+ */
+void lcode_compile_select(lcode *c, lval *v, int tail)
+{
+	int depth = c->depth;
+
+	lcode_compile_expr(c, v->cell[0]);
+	lcode_emit(c, OP_GUARD);
+	lcode_emit(c, lcode_const(c, lval_builtin(builtin_select)));
+	int generic = lcode_emit(c, 0);
+	lcode_stack(c, -1);
+
+	/* A condition that is not a Number ends the select, as each body does */
+	int failed[v->count];
+	int ends[v->count];
+	for (int i = 1; i < v->count; i++)
+	{
+		c->depth = depth;
+		lcode_compile_item(c, v->cell[i]->cell[0], 0);
+		lcode_emit(c, OP_BRANCH);
+		lcode_emit(c, lcode_const(c, lval_sym("select")));
+		int alt = lcode_emit(c, 0);
+		failed[i] = lcode_emit(c, 0);
+		lcode_stack(c, -1);
+
+		lcode_compile_item(c, v->cell[i]->cell[1], tail);
+		lcode_emit(c, OP_JUMP);
+		ends[i] = lcode_emit(c, 0);
+		c->ops[alt] = c->count;
+	}
+
+	c->depth = depth;
+	lcode_emit(c, OP_CONST);
+	lcode_emit(c, lcode_const(c, lval_err("No selection found")));
+	lcode_stack(c, 1);
+	lcode_emit(c, OP_JUMP);
+	ends[0] = lcode_emit(c, 0);
+
+	c->ops[generic] = c->count;
+	lcode_compile_generic(c, v, depth, tail);
+
+	c->ops[ends[0]] = c->count;
+	for (int i = 1; i < v->count; i++)
+	{
+		c->ops[failed[i]] = c->ops[ends[i]] = c->count;
+	}
+}
+
+/* Whether the key of a 'case' clause evaluates to itself, so it can go in a table */
+int lcode_is_key(lval *k)
+{
+	return LTYPE(k) == LVAL_NUM || LTYPE(k) == LVAL_STR || LTYPE(k) == LVAL_QEXPR;
+}
+
+/*
+ * Compile (case x {k b} ...), where every key is a constant, to jump through a
+ * table straight to the body of the first clause whose key equals x.
+ */
+void lcode_compile_case(lcode *c, lval *v, int tail)
+{
+	int depth = c->depth;
+
+	lcode_compile_expr(c, v->cell[0]);
+	lcode_emit(c, OP_GUARD);
+	lcode_emit(c, lcode_const(c, lval_builtin(builtin_case)));
+	int generic = lcode_emit(c, 0);
+	lcode_stack(c, -1);
+
+	/* The switch jumps to the end itself when there is no clause for the value */
+	lval *keys[v->count];
+	int addrs[v->count];
+	int ends[v->count];
+	int t = c->switches_count++;
+	lcode_compile_expr(c, v->cell[1]);
+	lcode_emit(c, OP_SWITCH);
+	lcode_emit(c, t);
+	ends[1] = lcode_emit(c, 0);
+	lcode_stack(c, -1);
+
+	for (int i = 2; i < v->count; i++)
+	{
+		c->depth = depth;
+		keys[i] = v->cell[i]->cell[0];
+		addrs[i] = c->count;
+		lcode_compile_item(c, v->cell[i]->cell[1], tail);
+		lcode_emit(c, OP_JUMP);
+		ends[i] = lcode_emit(c, 0);
+	}
+
+	c->ops[generic] = c->count;
+	lcode_compile_generic(c, v, depth, tail);
+
+	for (int i = 1; i < v->count; i++)
+	{
+		c->ops[ends[i]] = c->count;
+	}
+
+	c->switches = realloc(c->switches, sizeof(struct lswitch) * c->switches_count);
+	lswitch_init(&c->switches[t], keys + 2, addrs + 2, v->count - 2);
+}
+
+/* Compile code pushing the value of the S-Expression v, or returning it if tail is set */
+void lcode_compile_sexpr(lcode *c, lval *v, int tail)
+{
+	if (lcode_is_form(v, intern("if"), 3, 2))
+	{
+		lcode_compile_if(c, v, tail);
+		return;
+	}
+
+	if (lcode_is_clauses(v, intern("select"), 1))
+	{
+		lcode_compile_select(c, v, tail);
+		return;
+	}
+
+	if (lcode_is_call(v, intern("do"), builtin_do, 1))
+	{
+		lcode_compile_do(c, v, tail);
+		return;
+	}
+
+	if (lcode_is_clauses(v, intern("case"), 2))
+	{
+		int keys = 1;
+		for (int i = 2; i < v->count; i++)
+		{
+			keys = keys && lcode_is_key(v->cell[i]->cell[0]);
+		}
+
+		/* Otherwise the builtin evaluates the keys in turn */
+		if (keys)
+		{
+			lcode_compile_case(c, v, tail);
+			return;
+		}
+	}
+
+	if (lcode_is_form(v, intern("\\"), 2, 2))
+	{
+		int symbols = 1;
+		for (int i = 0; i < v->cell[1]->count; i++)
+		{
+			symbols = symbols && LTYPE(v->cell[1]->cell[i]) == LVAL_SYM;
+		}
+
+		/* Otherwise leave the error to the builtin */
+		if (symbols && formals_valid(v->cell[1]))
+		{
+			lcode_compile_lambda(c, v);
+			return;
+		}
+	}
+
+	for (int i = 0; i < v->count; i++)
+	{
+		lcode_compile_expr(c, v->cell[i]);
+	}
+	lcode_emit(c, tail ? OP_TAIL_CALL : OP_CALL);
+	lcode_emit(c, v->count);
+	lcode_stack(c, 1 - v->count);
+}
+
+/* Compile the list v to code returning its value as an S-Expression */
+lcode *lcode_compile(lval *v)
+{
+	lcode *c = lcode_new();
+	lcode_compile_sexpr(c, v, 1);
+	lcode_emit(c, OP_RETURN);
+	lcode_thread(c);
+	return c;
+}
+
+/* Calls of a function body before its code is compiled to machine code */
+#define JIT_THRESHOLD 64
+
+/* Set by --no-jit */
+int jit_enabled = 1;
+
+/* Code for the function body body, compiling it the first time */
+lcode *lval_code(lval *body)
+{
+	if (!body->code)
+	{
+		body->code = lcode_compile(body);
+	}
+	/* The count stops at the threshold, so the code is only ever compiled once */
+	if (jit_enabled && body->code->calls < JIT_THRESHOLD && ++body->code->calls == JIT_THRESHOLD)
+	{
+		jit_compile(body->code);
+	}
+	return body->code;
+}
+
+/* Stack of values shared by all runs of the VM */
+lval **vm_stack = NULL;
+int vm_sp = 0;
+int vm_capacity = 0;
+
+/* Make room for n more values on the stack */
+void vm_reserve(int n)
+{
+	if (vm_sp + n <= vm_capacity)
+	{
+		return;
+	}
+	while (vm_sp + n > vm_capacity)
+	{
+		vm_capacity = vm_capacity ? vm_capacity * 2 : 256;
+	}
+	vm_stack = realloc(vm_stack, sizeof(lval *) * vm_capacity);
+}
+
+void vm_push(lval *x)
+{
+	vm_stack[vm_sp++] = x;
+}
+
+/* Pop the top n values into an S-Expression */
+lval *vm_pop_sexpr(int n)
+{
+	lval *v = lval_sexpr();
+	vm_sp -= n;
+	if (n)
+	{
+		v->cell = cells_alloc(n);
+		v->count = n;
+		memcpy(v->cell, vm_stack + vm_sp, sizeof(lval *) * n);
+	}
+	return v;
+}
+
+/*
+ * A function body or S-Expression being evaluated. Frames live on a stack of
+ * their own rather than the native one, so recursion is only limited by
+ * vm_stack_limit.
+ */
+struct vm_frame
+{
+	lenv *e;
+
+	/*
+	 * Bytecode being run, or NULL while evaluating the children of expr in turn.
+	 * While bytecode compiled from a frozen list is run, expr keeps the list.
+	 */
+	lcode *c;
+	int pc;
+	lval *expr;
+	int i;
+
+	/*
+	 * The values from base up belong to the frame. The first owners of them are
+	 * the functions whose environments it keeps alive, the last of which is e.
+	 */
+	int base;
+	int owners;
+
+	/* Frame to apply the single expression rule in before returning, if any */
+	lenv *single;
+};
+
+struct vm_frame *vm_frames = NULL;
+int vm_fp = 0;
+int vm_frames_capacity = 0;
+
+/* Most bytes the stacks of the VM may use, set with --stack-limit */
+long vm_stack_limit = 64L * 1024 * 1024;
+
+/* Push a frame evaluating in e, or return NULL if the stacks are at their limit */
+struct vm_frame *vm_push_frame(lenv *e)
+{
+	if ((long)sizeof(struct vm_frame) * (vm_fp + 1) + (long)sizeof(lval *) * vm_sp > vm_stack_limit)
+	{
+		return NULL;
+	}
+
+	/* Frames are reused once popped, so this only allocates as the stack first grows */
+	if (vm_fp == vm_frames_capacity)
+	{
+		vm_frames_capacity = vm_frames_capacity ? vm_frames_capacity * 2 : 64;
+		vm_frames = realloc(vm_frames, sizeof(struct vm_frame) * vm_frames_capacity);
+	}
+
+	struct vm_frame *fr = &vm_frames[vm_fp++];
+	fr->e = e;
+	fr->c = NULL;
+	fr->pc = 0;
+	fr->expr = NULL;
+	fr->i = 0;
+	fr->base = vm_sp;
+	fr->owners = 0;
+	fr->single = NULL;
+	return fr;
+}
+
+lval *vm_stack_error(void)
+{
+	return lval_err("Stack limit of %li bytes reached.", vm_stack_limit);
+}
+
+/* Let go of the frozen list frame fr was running, once it has nothing left to do */
+void vm_frame_release(struct vm_frame *fr)
+{
+	if (fr->expr)
+	{
+		lval_del(fr->expr);
+		fr->expr = NULL;
+	}
+}
+
+/* Set frame fr to run the body of lambda f, which it owns from now on */
+void vm_frame_code(struct vm_frame *fr, lval *f)
+{
+	vm_frame_release(fr);
+	fr->e = f->env;
+	fr->c = lval_code(f->body);
+	fr->pc = 0;
+
+	vm_reserve(fr->c->max_depth + 1);
+	vm_push(f);
+	fr->owners++;
+}
+
+/* Set frame fr to evaluate the S-Expression x */
+void vm_frame_expr(struct vm_frame *fr, lval *x)
+{
+	vm_frame_release(fr);
+
+	/* ((f x)) is evaluated as (f x), applying the single expression rule to its value */
+	while (x->count == 1 && LTYPE(x->cell[0]) == LVAL_SEXPR)
+	{
+		lval *y = lval_copy(x->cell[0]);
+		lval_del(x);
+		x = y;
+		fr->single = fr->e;
+	}
+
+	/* Frozen lists are run from the code compiled from them, leaving them as they are */
+	if (LVAL_IS_FROZEN(x))
+	{
+		fr->c = lval_code(x);
+		fr->pc = 0;
+		fr->expr = x;
+		vm_reserve(fr->c->max_depth + 1);
+		return;
+	}
+
+	/* Results replace the children in place */
+	fr->c = NULL;
+	fr->expr = lval_unshare(x);
+	fr->i = 0;
+}
+
+/* Whether every binding in frame f is hidden by a frame between e and f */
+int lenv_hidden(lenv *e, lenv *f)
+{
+	for (int i = 0; i < f->count; i++)
+	{
+		lenv *x = e;
+		while (x != f && lenv_find(x, f->syms[i]) < 0)
+		{
+			x = x->parent;
+		}
+		if (x == f)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Before frame fr makes a tail call running in e, drop the environments of its
+ * owners that e can no longer see. Under dynamic scope each owner's environment
+ * is the parent of the next, and as the owners have all finished bar their tail
+ * calls, nothing else can reach an environment whose bindings are all hidden,
+ * other than the one the single expression rule is still to be applied in.
+ * Under lexical scope e never sees them, and lambdas made in them have copies
+ * of what they need. Loops calling themselves then run in constant space.
+ */
+void vm_drop_hidden(struct vm_frame *fr, lenv *e)
+{
+	lenv *child = e;
+	for (int i = fr->base + fr->owners - 1; i >= fr->base; i--)
+	{
+		lenv *f = vm_stack[i]->env;
+		if (f == fr->single || (!lenv_lexical && !lenv_hidden(e, f)))
+		{
+			child = f;
+			continue;
+		}
+
+		if (!lenv_lexical)
+		{
+			child->parent = f->parent;
+		}
+		lval_del(vm_stack[i]);
+		memmove(&vm_stack[i], &vm_stack[i + 1], sizeof(lval *) * (vm_sp - i - 1));
+		vm_sp--;
+		fr->owners--;
+	}
+}
+
+/*
+ * Besides its bytecode, each function body is compiled once to an array of
+ * vm_insn, one per opcode, naming the C function that runs it with its operands
+ * decoded. The VM then runs a body as a sequence of indirect calls. Handlers
+ * return the position of the next opcode, or -1 to leave the opcode to vm_loop,
+ * which handles everything needing a frame.
+ *
+ * Loads and calls start out with handlers that look at the values they meet the
+ * first time they run and replace themselves with ones specialized to them: a
+ * load of a builtin keeps the builtin, and a call of arithmetic keeps the
+ * builtin to do inline, fused with the 'if' testing it for comparisons. A
+ * specialized handler checks its assumptions each time, and puts the general
+ * one back when they no longer hold.
+ */
+
+int vm_run_const(struct vm_insn *in)
+{
+	vm_push(lval_copy(in->k));
+	return in->next;
+}
+
+int vm_run_load(struct vm_insn *in)
+{
+	vm_push(lval_eval_sym(vm_frames[vm_fp - 1].e, in->k));
+	return in->next;
+}
+
+/* Load a builtin found the last time the global bindings changed */
+int vm_run_load_builtin(struct vm_insn *in);
+
+/* Load the symbol, and specialize to the builtin it is bound to globally if it is one */
+int vm_run_load_first(struct vm_insn *in)
+{
+	lval *x = lval_eval_sym(vm_frames[vm_fp - 1].e, in->k);
+	vm_push(x);
+
+	in->run = vm_run_load;
+	if (LTYPE(x) == LVAL_FUN && LVAL_IS_BUILTIN(x) && !LSYM(in->k->sym)->shadowed && lenv_find(lenv_global, in->k->sym) >= 0)
+	{
+		in->run = vm_run_load_builtin;
+		in->cache = lval_copy(x);
+		in->version = lenv_version;
+	}
+	return in->next;
+}
+
+int vm_run_load_builtin(struct vm_insn *in)
+{
+	if (in->version != lenv_version)
+	{
+		lval_del(in->cache);
+		in->cache = NULL;
+		return vm_run_load_first(in);
+	}
+
+	vm_push(lval_copy(in->cache));
+	return in->next;
+}
+
+/* Pop the top value if it is the builtin constant k, otherwise jump */
+int vm_run_guard(struct vm_insn *in)
+{
+	lval *x = vm_stack[vm_sp - 1];
+	if (LTYPE(x) == LVAL_FUN && LVAL_IS_BUILTIN(x) && x->builtin == in->k->builtin)
+	{
+		vm_sp--;
+		lval_del(x);
+		return in->next;
+	}
+	return in->alt;
+}
+
+/* Pop the condition of an 'if' or 'select', pushing an error in its place if it is not a Number */
+int vm_run_branch(struct vm_insn *in)
+{
+	lval *x = vm_stack[--vm_sp];
+	if (LTYPE(x) == LVAL_ERR)
+	{
+		vm_push(x);
+		return in->end;
+	}
+	if (LTYPE(x) != LVAL_NUM)
+	{
+		vm_push(lval_err("Function '%s' passed incorrect type. Expected %s, got %s.", in->k->sym, ltype_name(LVAL_NUM), ltype_name(LTYPE(x))));
+		lval_del(x);
+		return in->end;
+	}
+
+	int next = LNUM(x) ? in->next : in->alt;
+	lval_del(x);
+	return next;
+}
+
+/* Pop the value of a 'case' and go to its clause, pushing an error in its place if there is none */
+int vm_run_switch(struct vm_insn *in)
+{
+	lval *x = vm_stack[--vm_sp];
+	if (LTYPE(x) == LVAL_ERR)
+	{
+		vm_push(x);
+		return in->end;
+	}
+
+	int next = lswitch_find(in->sw, x);
+	lval_del(x);
+	if (next < 0)
+	{
+		vm_push(lval_err("No case found"));
+		return in->end;
+	}
+	return next;
+}
+
+int vm_run_jump(struct vm_insn *in)
+{
+	return in->alt;
+}
+
+/* Pop the value of an argument 'do' goes past, or keep it as the value of the 'do' if it is an error */
+int vm_run_drop(struct vm_insn *in)
+{
+	lval *x = vm_stack[vm_sp - 1];
+	if (LTYPE(x) == LVAL_ERR)
+	{
+		return in->alt;
+	}
+	vm_sp--;
+	lval_del(x);
+	return in->next;
+}
+
+int vm_run_lambda(struct vm_insn *in)
+{
+	lval *x = lval_lambda(lval_copy(in->k), lval_copy(in->body));
+	lenv_reserve(x->env, formal_slots(x->formals));
+	lval_close(x, vm_frames[vm_fp - 1].e);
+	vm_push(x);
+	return in->next;
+}
+
+/* Call a builtin on the top values, leaving lambdas and the builtins the VM runs itself to vm_loop */
+int vm_run_call(struct vm_insn *in)
+{
+	lval *f = vm_stack[vm_sp - in->n];
+
+	/* A single value other than a function is the value of the S-Expression */
+	if (in->n == 1 && LTYPE(f) != LVAL_FUN)
+	{
+		return in->next;
+	}
+	if (LTYPE(f) != LVAL_FUN || !LVAL_IS_BUILTIN(f) || f->builtin == builtin_eval || f->builtin == builtin_if || f->builtin == builtin_let ||
+		f->builtin == builtin_select || f->builtin == builtin_case)
+	{
+		return -1;
+	}
+
+	/* Builtins such as 'load' run the VM themselves, so the frame is looked up again after */
+	lval *x = lval_eval_call(vm_frames[vm_fp - 1].e, vm_pop_sexpr(in->n));
+	vm_push(x);
+	return in->next;
+}
+
+/* Numbers small enough that their product fits in a long */
+#define VM_MUL_MAX (1L << 31)
+
+/* Compute in->fn on the two immediates on top of the call in *r, and return whether it could */
+int vm_arith(struct vm_insn *in, long *r)
+{
+	lval **s = vm_stack + vm_sp - 3;
+	lval *f = s[0];
+	if (LVAL_IS_IMM(f) || f->type != LVAL_FUN || !LVAL_IS_BUILTIN(f) || f->builtin != in->fn || !LVAL_IS_IMM(s[1]) || !LVAL_IS_IMM(s[2]))
+	{
+		return 0;
+	}
+
+	/* Sums and differences of immediates always fit in a long */
+	long x = LNUM(s[1]);
+	long y = LNUM(s[2]);
+	if (in->fn == builtin_add)
+	{
+		*r = x + y;
+	}
+	else if (in->fn == builtin_sub)
+	{
+		*r = x - y;
+	}
+	else if (in->fn == builtin_mul)
+	{
+		if (x <= -VM_MUL_MAX || x >= VM_MUL_MAX || y <= -VM_MUL_MAX || y >= VM_MUL_MAX)
+		{
+			return 0;
+		}
+		*r = x * y;
+	}
+	else if (in->fn == builtin_lt)
+	{
+		*r = x < y;
+	}
+	else if (in->fn == builtin_gt)
+	{
+		*r = x > y;
+	}
+	else if (in->fn == builtin_le)
+	{
+		*r = x <= y;
+	}
+	else if (in->fn == builtin_ge)
+	{
+		*r = x >= y;
+	}
+	else if (in->fn == builtin_eq)
+	{
+		*r = x == y;
+	}
+	else
+	{
+		*r = x != y;
+	}
+
+	vm_sp -= 3;
+	lval_del(s[0]);
+	return 1;
+}
+
+/* Call in->fn on two immediates without building the S-Expression, otherwise call as usual */
+int vm_run_arith(struct vm_insn *in)
+{
+	long r;
+	if (!vm_arith(in, &r))
+	{
+		return vm_run_call(in);
+	}
+	vm_push(lval_num(r));
+	return in->next;
+}
+
+/* Compare two immediates with in->fn and take the 'if' after it straight away, without pushing the result */
+int vm_run_cmp_branch(struct vm_insn *in)
+{
+	struct vm_insn *branch = in + (in->next - in->pc);
+	long r;
+	if (!vm_arith(in, &r))
+	{
+		int next = vm_run_call(in);
+		return next < 0 ? next : branch->run(branch);
+	}
+	return r ? branch->next : branch->alt;
+}
+
+/* Specialize a call to the function it makes the first time */
+int vm_run_call_first(struct vm_insn *in)
+{
+	in->run = vm_run_call;
+
+	lval *f = vm_stack[vm_sp - in->n];
+	if (in->n == 3 && LTYPE(f) == LVAL_FUN && LVAL_IS_BUILTIN(f))
+	{
+		lbuiltin fns[] = {builtin_add, builtin_sub, builtin_mul, builtin_lt, builtin_gt, builtin_le, builtin_ge, builtin_eq, builtin_ne};
+		for (int i = 0; i < 9; i++)
+		{
+			if (f->builtin == fns[i])
+			{
+				in->fn = f->builtin;
+				in->run = vm_run_arith;
+
+				/* Comparisons tested by an 'if' straight after jump to its branches */
+				if (i >= 3 && in[in->next - in->pc].run == vm_run_branch)
+				{
+					in->run = vm_run_cmp_branch;
+				}
+				break;
+			}
+		}
+	}
+	return in->run(in);
+}
+
+/* Tail calls and returns always need vm_loop */
+int vm_run_leave(struct vm_insn *in)
+{
+	return -1;
+}
+
+/* Number of operands following op */
+int lcode_operands(int op)
+{
+	switch (op)
+	{
+	case OP_BRANCH:
+		return 3;
+	case OP_GUARD:
+	case OP_SWITCH:
+		return 2;
+	case OP_RETURN:
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+/* Compile the bytecode of c to its vm_insn */
+void lcode_thread(lcode *c)
+{
+	c->insns = calloc(c->count, sizeof(struct vm_insn));
+
+	for (int pc = 0; pc < c->count; pc += 1 + lcode_operands(c->ops[pc]))
+	{
+		struct vm_insn *in = &c->insns[pc];
+		int arg = pc + 1 < c->count ? c->ops[pc + 1] : 0;
+		in->pc = pc;
+		in->next = pc + 1 + lcode_operands(c->ops[pc]);
+
+		switch (c->ops[pc])
+		{
+		case OP_CONST:
+			in->run = vm_run_const;
+			in->k = c->consts[arg];
+			break;
+
+		case OP_LOAD:
+			in->run = vm_run_load_first;
+			in->k = c->consts[arg];
+			break;
+
+		case OP_GUARD:
+			in->run = vm_run_guard;
+			in->k = c->consts[arg];
+			in->alt = c->ops[pc + 2];
+			break;
+
+		case OP_BRANCH:
+			in->run = vm_run_branch;
+			in->k = c->consts[arg];
+			in->alt = c->ops[pc + 2];
+			in->end = c->ops[pc + 3];
+			break;
+
+		case OP_SWITCH:
+			in->run = vm_run_switch;
+			in->sw = &c->switches[arg];
+			in->end = c->ops[pc + 2];
+			break;
+
+		case OP_JUMP:
+			in->run = vm_run_jump;
+			in->alt = arg;
+			break;
+
+		case OP_DROP:
+			in->run = vm_run_drop;
+			in->alt = arg;
+			break;
+
+		case OP_LAMBDA:
+			in->run = vm_run_lambda;
+			in->k = c->consts[arg];
+			in->body = c->consts[arg + 1];
+			break;
+
+		case OP_CALL:
+			in->run = vm_run_call_first;
+			in->n = arg;
+			break;
+
+		default:
+			in->run = vm_run_leave;
+			break;
+		}
+	}
+}
+
+/* Run the VM until the frame below depth stop returns, and return its value */
+lval *vm_loop(int stop)
+{
+	for (;;)
+	{
+		/* Runs started by builtins leave values on the native stack, where they can't be marked */
+		if (stop == 0 && lval_boxes_made >= LVAL_COLLECT_BOXES)
+		{
+			lval_collect(lenv_global);
+		}
+
+		struct vm_frame *fr = &vm_frames[vm_fp - 1];
+		lcode *c = fr->c;
+
+		/* The S-Expression to apply next and whether it is the last thing the frame does */
+		lval *v;
+		int tail;
+
+		/* Value the frame returns */
+		lval *result;
+
+		if (!c)
+		{
+			/* Evaluate children, leaving S-Expressions to frames of their own */
+			lval *x = fr->expr;
+			while (fr->i < x->count && LTYPE(x->cell[fr->i]) != LVAL_SEXPR)
+			{
+				if (LTYPE(x->cell[fr->i]) == LVAL_SYM)
+				{
+					lval *y = lval_eval_sym(fr->e, x->cell[fr->i]);
+					lval_del(x->cell[fr->i]);
+					x->cell[fr->i] = y;
+				}
+				fr->i++;
+			}
+
+			/* The last argument of 'do' is evaluated in its place, once the others have no errors */
+			if (fr->i > 0 && fr->i == x->count - 1 && LTYPE(x->cell[0]) == LVAL_FUN &&
+				LVAL_IS_BUILTIN(x->cell[0]) && x->cell[0]->builtin == builtin_do)
+			{
+				int failed = 0;
+				for (int i = 1; i < fr->i; i++)
+				{
+					failed |= LTYPE(x->cell[i]) == LVAL_ERR;
+				}
+				if (!failed)
+				{
+					vm_frame_expr(fr, lval_pop(x, fr->i));
+					continue;
+				}
+			}
+
+			if (fr->i < x->count)
+			{
+				/* The child's value is stored over it when its frame returns */
+				lval *child = x->cell[fr->i];
+				lenv *e = fr->e;
+				struct vm_frame *nf = vm_push_frame(e);
+				if (!nf)
+				{
+					lval_del(child);
+					x->cell[fr->i++] = vm_stack_error();
+					continue;
+				}
+				vm_frame_expr(nf, child);
+				continue;
+			}
+
+			v = x;
+			fr->expr = NULL;
+			tail = 1;
+		}
+		else
+		{
+			/* Run the machine code or handlers up to the next opcode left to the loop */
+			int pc = fr->pc;
+			if (c->native)
+			{
+				pc = c->native(pc);
+			}
+			else
+			{
+				int next;
+				while ((next = c->insns[pc].run(&c->insns[pc])) >= 0)
+				{
+					pc = next;
+				}
+			}
+
+			/* Handlers such as a call of 'load' may have run the VM themselves, which moves the frames */
+			fr = &vm_frames[vm_fp - 1];
+			fr->pc = pc + 1;
+			switch (c->ops[pc])
+			{
+			case OP_CALL:
+				v = vm_pop_sexpr(c->ops[fr->pc++]);
+				tail = 0;
+				break;
+
+			case OP_TAIL_CALL:
+				v = vm_pop_sexpr(c->ops[fr->pc++]);
+				tail = 1;
+				break;
+
+			case OP_RETURN:
+			default:
+				v = NULL;
+				tail = 1;
+				break;
+			}
+		}
+
+		if (v)
+		{
+			lval *f;
+			lval *x;
+			lenv *e = fr->e;
+			result = lval_apply(e, v, &f, &x);
+
+			/* Builtins such as 'load' run the VM themselves, which may have moved the frames */
+			fr = &vm_frames[vm_fp - 1];
+
+			if (f || x)
+			{
+				if (tail)
+				{
+					/* Carry on in this frame, which has nothing left to do but return */
+					if (f)
+					{
+						if (!lenv_lexical)
+						{
+							f->env->parent = e;
+						}
+						vm_drop_hidden(fr, f->env);
+						vm_frame_code(fr, f);
+					}
+					else
+					{
+						vm_frame_expr(fr, x);
+					}
+					continue;
+				}
+
+				struct vm_frame *nf = vm_push_frame(e);
+				if (!nf)
+				{
+					lval_del(f ? f : x);
+					vm_push(vm_stack_error());
+					continue;
+				}
+				if (f)
+				{
+					if (!lenv_lexical)
+					{
+						f->env->parent = e;
+					}
+					vm_frame_code(nf, f);
+				}
+				else
+				{
+					vm_frame_expr(nf, x);
+				}
+				continue;
+			}
+
+			if (!tail)
+			{
+				vm_push(result);
+				continue;
+			}
+		}
+		else
+		{
+			result = vm_stack[--vm_sp];
+		}
+
+		/* Return result from the frame */
+		if (fr->single)
+		{
+			result = lval_eval_single(fr->single, result);
+		}
+		while (vm_sp > fr->base)
+		{
+			lval_del(vm_stack[--vm_sp]);
+		}
+		vm_frame_release(fr);
+		vm_fp--;
+
+		if (vm_fp == stop)
+		{
+			return result;
+		}
+
+		/* Hand the result to the frame below */
+		fr = &vm_frames[vm_fp - 1];
+		if (fr->c)
+		{
+			vm_push(result);
+		}
+		else
+		{
+			fr->expr->cell[fr->i++] = result;
+		}
+	}
+}
+
+/*
+ * Run the code c in the frame e. If the frame belongs to the function f the run
+ * takes ownership of f.
+ */
+lval *vm_run(lenv *e, lcode *c, lval *f)
+{
+	int stop = vm_fp;
+	struct vm_frame *fr = vm_push_frame(e);
+	if (!fr)
+	{
+		if (f)
+		{
+			lval_del(f);
+		}
+		return vm_stack_error();
+	}
+
+	fr->c = c;
+	vm_reserve(c->max_depth + 1);
+	if (f)
+	{
+		vm_push(f);
+		fr->owners = 1;
+	}
+	return vm_loop(stop);
+}
+
+/* Evaluate the S-Expression v in e, taking ownership of v */
+lval *vm_eval_expr(lenv *e, lval *v)
+{
+	int stop = vm_fp;
+	struct vm_frame *fr = vm_push_frame(e);
+	if (!fr)
+	{
+		lval_del(v);
+		return vm_stack_error();
+	}
+
+	vm_frame_expr(fr, v);
+	return vm_loop(stop);
+}
+
+/* Evaluate v by compiling it first, taking ownership of v */
+lval *vm_eval(lenv *e, lval *v)
+{
+	if (LTYPE(v) != LVAL_SEXPR)
+	{
+		return lval_eval(e, v);
+	}
+
+	lcode *c = lcode_compile(v);
+	lval_del(v);
+	lval *x = vm_run(e, c, NULL);
+	lcode_del(c);
+	return x;
+}
+
+lval *builtin_var(lenv *e, lval *a, char *func)
+{
+	LASSERT_TYPE(a, 0, LVAL_QEXPR, func);
+
+	/* First argument is symbol list */
+	lval *syms = a->cell[0];
+
+	/* Ensure all elements of first list are symbols */
+	for (int i = 0; i < syms->count; ++i)
+	{
+		LASSERT(a, LTYPE(syms->cell[i]) == LVAL_SYM, "Function '%s' cannot define non-symbol. Got %s.", func, ltype_name(LTYPE(syms->cell[i])));
+	}
+
+	/* Ensure no elements are builtins */
+	for (int i = 0; i < syms->count; ++i)
+	{
+		for (int j = 0; j < e->builtins_count; ++j)
+		{
+			LASSERT(a, syms->cell[i]->sym != e->builtins[j], "Function '%s' cannot redefine builtin '%s'", func, e->builtins[j]);
+		}
+	}
+
+	/* Check correct number of symbols and values */
+	LASSERT(a, syms->count == a->count - 1, "Function '%s' cannot define incorrect number of values to symbols. Got %i symbols but %i values.", func, syms->count, a->count - 1);
+
+	/* Move the values into their bindings */
+	syms = lval_pop(a, 0);
+	for (int i = 0; i < syms->count; ++i)
+	{
+		lval *v = a->cell[i];
+		if (strcmp(func, "def") == 0)
+		{
+			lenv_def(e, syms->cell[i], v);
+		}
+		if (strcmp(func, "=") == 0)
+		{
+			lenv_put_move(e, syms->cell[i], v);
+		}
+	}
+
+	lval_drop(a);
+	lval_del(syms);
+	return lval_sexpr();
+}
+
+lval *builtin_def(lenv *e, lval *a)
+{
+	return builtin_var(e, a, "def");
+}
+
+lval *builtin_put(lenv *e, lval *a)
+{
+	return builtin_var(e, a, "=");
+}
+
+/* (fun {name formals} body) defines name as (\ {formals} body) */
+lval *builtin_fun(lenv *e, lval *a)
+{
+	LASSERT_NUM_ARGS(a, 2, "fun");
+	LASSERT_TYPE(a, 0, LVAL_QEXPR, "fun");
+	LASSERT_TYPE(a, 1, LVAL_QEXPR, "fun");
+	LASSERT_NOT_EMPTY_LIST(a, "fun");
+	LASSERT(a, LTYPE(a->cell[0]->cell[0]) == LVAL_SYM, "Function 'fun' cannot define non-symbol. Got %s.", ltype_name(LTYPE(a->cell[0]->cell[0])));
+
+	lval *formals = lval_unshare(lval_pop(a, 0));
+	lval *name = lval_pop(formals, 0);
+	lval *f = builtin_lambda(e, lval_add(lval_add(lval_sexpr(), formals), lval_take(a, 0)));
+	if (LTYPE(f) == LVAL_ERR)
+	{
+		lval_del(name);
+		return f;
+	}
+
+	/* The prelude rebinds some builtins with 'fun', so unlike 'def' this may */
+	lenv_def(e, name, f);
+	lval_del(name);
+	return lval_sexpr();
+}
+
+/* Evaluate the body in a new scope, whose bindings go once it is done */
+lval *builtin_let(lenv *e, lval *a)
+{
+	LASSERT_NUM_ARGS(a, 1, "let");
+	LASSERT_TYPE(a, 0, LVAL_QEXPR, "let");
+
+	return lval_run(e, lval_scope(e, lval_take(a, 0)));
+}
+
+/*
+ * Return the last of the arguments, which have been evaluated in turn. The VM
+ * evaluates the last argument in place of the call when it reaches it, so that
+ * this only sees its value when 'do' is called from a builtin.
+ */
+lval *builtin_do(lenv *e, lval *a)
+{
+	if (a->count == 0)
+	{
+		lval_del(a);
+		return lval_qexpr();
+	}
+	return lval_take(a, a->count - 1);
+}
+
+lval *builtin_exit(lenv *e, lval *a)
+{
+	return lval_exit();
+}
+
+lval *builtin_deflist(lenv *e, lval *a)
+{
+	for (int i = 0; i < e->count; ++i)
+	{
+		printf("%s\t", e->syms[i]);
+	}
+	printf("\n");
+	return lval_sexpr();
+}
+
+lval *builtin_ord(lenv *e, lval *a, char *op)
+{
+	LASSERT_NUM_ARGS(a, 2, op);
+	LASSERT_TYPE(a, 0, LVAL_NUM, op);
+	LASSERT_TYPE(a, 1, LVAL_NUM, op);
+
+	int r = 0;
+
+	if (strcmp(op, ">") == 0)
+	{
+		r = (LNUM(a->cell[0]) > LNUM(a->cell[1]));
+	}
+	else if (strcmp(op, "<") == 0)
+	{
+		r = (LNUM(a->cell[0]) < LNUM(a->cell[1]));
+	}
+	else if (strcmp(op, ">=") == 0)
+	{
+		r = (LNUM(a->cell[0]) >= LNUM(a->cell[1]));
+	}
+	else if (strcmp(op, "<=") == 0)
+	{
+		r = (LNUM(a->cell[0]) <= LNUM(a->cell[1]));
+	}
+
+	lval_del(a);
+	return lval_num(r);
+}
+
+lval *builtin_gt(lenv *e, lval *a)
+{
+	return builtin_ord(e, a, ">");
+}
+
+lval *builtin_lt(lenv *e, lval *a)
+{
+	return builtin_ord(e, a, "<");
+}
+
+lval *builtin_ge(lenv *e, lval *a)
+{
+	return builtin_ord(e, a, ">=");
+}
+
+lval *builtin_le(lenv *e, lval *a)
+{
+	return builtin_ord(e, a, "<=");
+}
+
+int lval_eq(lval *x, lval *y)
+{
+	/* Shared values and equal immediates are the same pointer */
+	if (x == y)
+	{
+		return 1;
+	}
+
+	if (LTYPE(x) != LTYPE(y))
+	{
+		return 0;
+	}
+
+	switch (LTYPE(x))
+	{
+	case LVAL_NUM:
+		return (LNUM(x) == LNUM(y));
+	case LVAL_ERR:
+		return strcmp(x->err, y->err) == 0;
+	case LVAL_SYM:
+		return x->sym == y->sym;
+	case LVAL_STR:
+		return strcmp(x->str, y->str) == 0;
+	case LVAL_FUN:
+		if (LVAL_IS_BUILTIN(x) || LVAL_IS_BUILTIN(y))
+		{
+			return LVAL_IS_BUILTIN(x) && LVAL_IS_BUILTIN(y) && x->builtin == y->builtin;
+		}
+		return x->env->bound == y->env->bound && lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
+	case LVAL_QEXPR:
+	case LVAL_SEXPR:
+		if (x->count != y->count)
+		{
+			return 0;
+		}
+		for (int i = 0; i < x->count; i++)
+		{
+			if (!lval_eq(x->cell[i], y->cell[i]))
+			{
+				return 0;
+			}
+		}
+		return 1;
+	case LVAL_EXIT:
+		return 1;
+	}
+
+	return 0;
+}
+
+lval *builtin_cmp(lenv *e, lval *a, char *op)
+{
+	LASSERT_NUM_ARGS(a, 2, op);
+
+	int r = 0;
+
+	if (strcmp(op, "==") == 0)
+	{
+		r = lval_eq(a->cell[0], a->cell[1]);
+	}
+	else if (strcmp(op, "!=") == 0)
+	{
+		r = !lval_eq(a->cell[0], a->cell[1]);
+	}
+
+	lval_del(a);
+	return lval_num(r);
+}
+
+lval *builtin_eq(lenv *e, lval *a)
+{
+	return builtin_cmp(e, a, "==");
+}
+
+lval *builtin_ne(lenv *e, lval *a)
+{
+	return builtin_cmp(e, a, "!=");
+}
+
+lval *builtin_if(lenv *e, lval *a)
+{
+	LASSERT_NUM_ARGS(a, 3, "if");
+	LASSERT_TYPE(a, 0, LVAL_NUM, "if");
+	LASSERT_TYPE(a, 1, LVAL_QEXPR, "if");
+	LASSERT_TYPE(a, 2, LVAL_QEXPR, "if");
+
+	/* Take the chosen branch, which may be shared with a function body */
+	lval *x = lval_unshare(lval_pop(a, LNUM(a->cell[0]) ? 1 : 2));
+	x->type = LVAL_SEXPR;
+
+	lval_del(a);
+	return lval_eval(e, x);
+}
+
+/* Evaluate y as an S-Expression of its own, as 'eval' does {y} */
+lval *lval_eval_item(lenv *e, lval *y)
+{
+	return lval_eval(e, lval_add(lval_sexpr(), lval_copy(y)));
+}
+
+/* Check that the arguments of func from first on are clauses of two values */
+#define LASSERT_CLAUSES(a, first, func)                                                                                      \
+	for (int i = first; i < a->count; i++)                                                                                   \
+	{                                                                                                                        \
+		LASSERT_TYPE(a, i, LVAL_QEXPR, func);                                                                                \
+		LASSERT(a, a->cell[i]->count == 2, "Function '%s' passed a clause of %i values. Expected 2.", func, a->cell[i]->count); \
+	}
+
+/*
+ * Return the body of the first clause of a whose condition holds, or with
+ * 'case' if keyed is set, whose key equals the first argument, evaluating the
+ * conditions or keys in turn. Returns an error instead if there is one or no
+ * clause is chosen. Takes ownership of a.
+ */
+lval *lval_clause(lenv *e, lval *a, int keyed)
+{
+	char *func = keyed ? "case" : "select";
+	if (keyed)
+	{
+		LASSERT(a, a->count > 0, "Function 'case' passed incorrect number of arguments. Got %i, expected at least %i.", a->count, 1);
+	}
+	LASSERT_CLAUSES(a, keyed, func);
+
+	for (int i = keyed; i < a->count; i++)
+	{
+		lval *x = lval_eval_item(e, a->cell[i]->cell[0]);
+		if (LTYPE(x) == LVAL_ERR)
+		{
+			lval_del(a);
+			return x;
+		}
+
+		enum lval_type t = LTYPE(x);
+		int chosen = keyed ? lval_eq(a->cell[0], x) : t == LVAL_NUM && LNUM(x) != 0;
+		lval_del(x);
+		LASSERT(a, keyed || t == LVAL_NUM, "Function '%s' passed incorrect type. Expected %s, got %s.", func, ltype_name(LVAL_NUM), ltype_name(t));
+		if (chosen)
+		{
+			x = lval_copy(a->cell[i]->cell[1]);
+			lval_del(a);
+			return x;
+		}
+	}
+
+	lval_del(a);
+	return lval_err(keyed ? "No case found" : "No selection found");
+}
+
+/* Evaluate the body of the first clause whose condition holds, the conditions being evaluated in turn */
+lval *builtin_select(lenv *e, lval *a)
+{
+	lval *x = lval_clause(e, a, 0);
+	if (LTYPE(x) == LVAL_ERR)
+	{
+		return x;
+	}
+	lval *y = lval_eval_item(e, x);
+	lval_del(x);
+	return y;
+}
+
+/* Evaluate the body of the first clause whose key equals the first argument, the keys being evaluated in turn */
+lval *builtin_case(lenv *e, lval *a)
+{
+	lval *x = lval_clause(e, a, 1);
+	if (LTYPE(x) == LVAL_ERR)
+	{
+		return x;
+	}
+	lval *y = lval_eval_item(e, x);
+	lval_del(x);
+	return y;
+}
+
+lval *builtin_or(lenv *e, lval *a)
+{
+	LASSERT_NUM_ARGS(a, 2, "||");
+	LASSERT_TYPE(a, 0, LVAL_NUM, "||");
+	LASSERT_TYPE(a, 1, LVAL_NUM, "||");
+
+	int r = LNUM(a->cell[0]) != 0 || LNUM(a->cell[1]) != 0;
+
+	lval_del(a);
+	return lval_num(r);
+}
+
+lval *builtin_and(lenv *e, lval *a)
+{
+	LASSERT_NUM_ARGS(a, 2, "&&");
+	LASSERT_TYPE(a, 0, LVAL_NUM, "&&");
+	LASSERT_TYPE(a, 1, LVAL_NUM, "&&");
+
+	int r = LNUM(a->cell[0]) != 0 && LNUM(a->cell[1]) != 0;
+
+	lval_del(a);
+	return lval_num(r);
+}
+
+lval *builtin_not(lenv *e, lval *a)
+{
+	LASSERT_NUM_ARGS(a, 1, "!");
+	LASSERT_TYPE(a, 0, LVAL_NUM, "!");
+
+	int r = LNUM(a->cell[0]) == 0;
+
+	lval_del(a);
+	return lval_num(r);
+}
+
+/* Cycle collection */
+
+/*
+ * A box can come to hold a lambda that captured it, as when a frame binds a
+ * helper that calls itself by name, and reference counting alone never frees
+ * such a cycle. No other value is changed once it is shared, so nothing else
+ * can form one. From time to time everything reachable from the global
+ * environment and the stacks of the VM is marked, and each box left unmarked
+ * is emptied, after which reference counting frees the rest of its cycle.
+ */
+
+/*
+ * Values and environments still to be marked, so that marking takes no native
+ * stack however deeply lists nest. Exactly one of v and e is set in each.
+ */
+struct lmark
+{
+	lval *v;
+	lenv *e;
+};
+struct lmark *lval_marks = NULL;
+int lval_marks_count = 0;
+int lval_marks_capacity = 0;
+
+void lval_mark_push(lval *v, lenv *e)
+{
+	if (lval_marks_count == lval_marks_capacity)
+	{
+		lval_marks_capacity = lval_marks_capacity ? lval_marks_capacity * 2 : 256;
+		lval_marks = realloc(lval_marks, sizeof(struct lmark) * lval_marks_capacity);
+	}
+	lval_marks[lval_marks_count].v = v;
+	lval_marks[lval_marks_count].e = e;
+	lval_marks_count++;
+}
+
+/* Set or clear the mark of v, leaving what it holds that may lead to a box to be marked */
+void lval_mark_one(lval *v, int mark)
+{
+	if (LVAL_IS_IMM(v) || ((v->flags & LVAL_MARKED) != 0) == mark)
+	{
+		return;
+	}
+
+	switch (v->type)
+	{
+	case LVAL_FUN:
+		if (!LVAL_IS_BUILTIN(v))
+		{
+			v->flags ^= LVAL_MARKED;
+			lval_mark_push(NULL, v->env);
+			lval_mark_push(v->body, NULL);
+		}
+		break;
+
+	case LVAL_SEXPR:
+	case LVAL_QEXPR:
+		v->flags ^= LVAL_MARKED;
+		for (int i = 0; i < v->count; i++)
+		{
+			lval_mark_push(v->cell[i], NULL);
+		}
+		break;
+
+	case LVAL_BOX:
+		v->flags ^= LVAL_MARKED;
+		if (v->boxed)
+		{
+			lval_mark_push(v->boxed, NULL);
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+/* Set or clear the mark of e, leaving what it holds to be marked */
+void lenv_mark_one(lenv *e, int mark)
+{
+	if (e->marked == mark)
+	{
+		return;
+	}
+	e->marked = mark;
+
+	for (int i = 0; i < e->count; i++)
+	{
+		lval_mark_push(e->vals[i], NULL);
+	}
+	if (e->body)
+	{
+		lval_mark_push(e->body, NULL);
+	}
+	/* Parents are only owned under lexical scope, see lenv_del */
+	if (lenv_lexical && e->parent && e->parent != lenv_global)
+	{
+		lval_mark_push(NULL, e->parent);
+	}
+}
+
+/* Set or clear the marks of what is left to be marked and of all it reaches */
+void lval_mark_drain(int mark)
+{
+	while (lval_marks_count > 0)
+	{
+		struct lmark m = lval_marks[--lval_marks_count];
+		if (m.v)
+		{
+			lval_mark_one(m.v, mark);
+		}
+		else
+		{
+			lenv_mark_one(m.e, mark);
+		}
+	}
+}
+
+/* Set or clear the mark of v and of what it holds that may lead to a box */
+void lval_mark(lval *v, int mark)
+{
+	lval_mark_push(v, NULL);
+	lval_mark_drain(mark);
+}
+
+void lenv_mark(lenv *e, int mark)
+{
+	lval_mark_push(NULL, e);
+	lval_mark_drain(mark);
+}
+
+/* Set or clear the marks of what e, if any, and the stacks of the VM reach */
+void lval_mark_roots(lenv *e, int mark)
+{
+	if (e)
+	{
+		lenv_mark(e, mark);
+	}
+	for (int i = 0; i < vm_sp; i++)
+	{
+		lval_mark(vm_stack[i], mark);
+	}
+	for (int i = 0; i < vm_fp; i++)
+	{
+		struct vm_frame *fr = &vm_frames[i];
+		lenv_mark(fr->e, mark);
+		if (fr->single)
+		{
+			lenv_mark(fr->single, mark);
+		}
+		if (fr->c && fr->expr)
+		{
+			lval_mark(fr->expr, mark);
+		}
+		else if (fr->expr)
+		{
+			/* Skip the child handed over to the frame above, which its value replaces later */
+			for (int j = 0; j < fr->expr->count; j++)
+			{
+				if (j != fr->i || i == vm_fp - 1)
+				{
+					lval_mark(fr->expr->cell[j], mark);
+				}
+			}
+		}
+	}
+}
+
+/*
+ * Empty every box that neither e, if any, nor the stacks of the VM reach. Only
+ * call this when nothing else holds values, which is between top level forms
+ * or between the steps of a run of the VM that no builtin started.
+ */
+void lval_collect(lenv *e)
+{
+	lval_mark_roots(e, 1);
+
+	/* Take a share of each box left unmarked, so that none goes while they are emptied */
+	int n = 0;
+	for (lval *b = lval_boxes; b; b = b->box_next)
+	{
+		n += !(b->flags & LVAL_MARKED);
+	}
+	lval **dead = malloc(sizeof(lval *) * (n ? n : 1));
+	n = 0;
+	for (lval *b = lval_boxes; b; b = b->box_next)
+	{
+		if (!(b->flags & LVAL_MARKED))
+		{
+			dead[n++] = lval_copy(b);
+		}
+	}
+
+	lval_mark_roots(e, 0);
+
+	for (int i = 0; i < n; i++)
+	{
+		if (dead[i]->boxed)
+		{
+			lval *x = dead[i]->boxed;
+			dead[i]->boxed = NULL;
+			lval_del(x);
+		}
+	}
+	for (int i = 0; i < n; i++)
+	{
+		lval_del(dead[i]);
+	}
+	free(dead);
+
+	boxes_collected += n;
+	lval_boxes_made = 0;
+}
+
+/* Evaluate a top level form x of a file, printing any error */
+void load_eval(lenv *e, lval *x)
+{
+	/* Between top level forms nothing but the global environment holds values */
+	if (vm_fp == 0 && lval_boxes_made)
+	{
+		lval_collect(lenv_global);
+	}
+
+	x = vm_eval(e, x);
+	if (LTYPE(x) == LVAL_ERR)
+	{
+		lval_println(e, x);
+	}
+	lval_del(x);
+}
+
+lval *builtin_load(lenv *e, lval *a)
+{
+	LASSERT_NUM_ARGS(a, 1, "load");
+	LASSERT_TYPE(a, 0, LVAL_STR, "load");
+
+	mpc_result_t r;
+	if (mpc_parse_contents(a->cell[0]->str, Lispy, &r))
+	{
+		lval *expr = lval_read(r.output);
+		mpc_ast_delete(r.output);
+
+		while (expr->count)
+		{
+			load_eval(e, lval_pop(expr, 0));
+		}
+
+		lval_del(expr);
+		lval_del(a);
+		return lval_sexpr();
+	}
+	else
+	{
+		char *err_msg = mpc_err_string(r.error);
+		mpc_err_delete(r.error);
+
+		lval *err = lval_err("Could not load library %s", err_msg);
+
+		free(err_msg);
+		lval_del(a);
+		return err;
+	}
+}
+
+lval *builtin_print(lenv *e, lval *a)
+{
+	for (int i = 0; i < a->count; i++)
+	{
+		lval_print(e, a->cell[i]);
+		putchar(' ');
+	}
+	putchar('\n');
+
+	lval_del(a);
+	return lval_sexpr();
+}
+
+lval *builtin_error(lenv *e, lval *a)
+{
+	LASSERT_NUM_ARGS(a, 1, "error");
+	LASSERT_TYPE(a, 0, LVAL_STR, "error");
+
+	lval *err = lval_err(a->cell[0]->str);
+
+	lval_del(a);
+	return err;
+}
+
+lval *builtin_memstats(lenv *e, lval *a)
+{
+	printf("values: %li live, %li recycled\n", lval_pool.live, lval_pool.recycled);
+	printf("cells: %li live, %li recycled\n", cells_live, cells_recycled);
+	printf("envs: %li live, %li recycled\n", lenv_live, lenv_recycled);
+	printf("boxes: %li live, %li collected\n", boxes_live, boxes_collected);
+	printf("copies: %li shared, %li unshared\n", lval_copies, lval_unshared);
+
+	lval_del(a);
+	return lval_sexpr();
+}
+
+char *find_builtin(lenv *e, lbuiltin b)
+{
+	for (int i = 0; i < e->count; ++i)
+	{
+		if (LTYPE(e->vals[i]) == LVAL_FUN && LVAL_IS_BUILTIN(e->vals[i]) && e->vals[i]->builtin == b)
+		{
+			return e->syms[i];
+		}
+	}
+	return "unknown";
+}
+
+/* Name of a lambda bound in e whose body has the code c, or NULL if there is none */
+char *find_lambda(lenv *e, lcode *c)
+{
+	for (int i = 0; i < e->count; ++i)
+	{
+		lval *v = e->vals[i];
+		if (LTYPE(v) == LVAL_FUN && !LVAL_IS_BUILTIN(v) && v->body->code == c)
+		{
+			return e->syms[i];
+		}
+	}
+	return NULL;
+}
+
+/* JIT */
+
+/*
+ * Hot function bodies are compiled to x86-64 machine code made of a template for
+ * each opcode. Most templates call the opcode's handler, while integer
+ * arithmetic and comparisons of immediates are done inline. Opcodes the handlers
+ * leave to vm_loop are left to it here too. The machine code returns the
+ * position in the bytecode to carry on from, and can be entered again at any
+ * opcode.
+ */
+
+#if LJIT
+
+/* Machine code being written */
+struct jit_buf
+{
+	unsigned char *code;
+	int count;
+	int capacity;
+
+	/* Jumps to the code for an opcode, patched once all the code is written */
+	int fixups_count;
+	int *fixups_at;
+	int *fixups_pc;
+};
+
+void jit_emit(struct jit_buf *b, char *bytes, int n)
+{
+	if (b->count + n > b->capacity)
+	{
+		b->capacity = (b->count + n) * 2;
+		b->code = realloc(b->code, b->capacity);
+	}
+	memcpy(b->code + b->count, bytes, n);
+	b->count += n;
+}
+
+void jit_u8(struct jit_buf *b, int x)
+{
+	char c = x;
+	jit_emit(b, &c, 1);
+}
+
+void jit_u32(struct jit_buf *b, uint32_t x)
+{
+	jit_emit(b, (char *)&x, 4);
+}
+
+void jit_u64(struct jit_buf *b, uint64_t x)
+{
+	jit_emit(b, (char *)&x, 8);
+}
+
+/* Emit a jump with condition code cc, or an unconditional one if cc is -1, and return where its offset goes */
+int jit_jump(struct jit_buf *b, int cc)
+{
+	if (cc < 0)
+	{
+		jit_u8(b, 0xE9);
+	}
+	else
+	{
+		jit_emit(b, "\x0F", 1);
+		jit_u8(b, 0x80 | cc);
+	}
+	jit_u32(b, 0);
+	return b->count - 4;
+}
+
+/* Point the jump whose offset is at the current position */
+void jit_land(struct jit_buf *b, int at)
+{
+	int32_t rel = b->count - (at + 4);
+	memcpy(b->code + at, &rel, 4);
+}
+
+/* Jump to the code for the opcode at pc */
+void jit_jump_pc(struct jit_buf *b, int cc, int pc)
+{
+	int at = jit_jump(b, cc);
+	b->fixups_at = realloc(b->fixups_at, sizeof(int) * (b->fixups_count + 1));
+	b->fixups_pc = realloc(b->fixups_pc, sizeof(int) * (b->fixups_count + 1));
+	b->fixups_at[b->fixups_count] = at;
+	b->fixups_pc[b->fixups_count] = pc;
+	b->fixups_count++;
+}
+
+/* Condition codes */
+#define JIT_O 0x0
+#define JIT_E 0x4
+#define JIT_NE 0x5
+#define JIT_LE 0xE
+
+/* Call the handler of in, which may replace itself, so it is read from in each time */
+void jit_call_insn(struct jit_buf *b, struct vm_insn *in)
+{
+	/* mov rdi, in; call [rdi] */
+	jit_emit(b, "\x48\xBF", 2);
+	jit_u64(b, (uint64_t)(uintptr_t)in);
+	jit_emit(b, "\xFF\x17", 2);
+}
+
+/* Compare the position a handler returned with pc: cmp eax, pc */
+void jit_cmp_pc(struct jit_buf *b, int pc)
+{
+	jit_u8(b, 0x3D);
+	jit_u32(b, pc);
+}
+
+/* Jump to the code at offset dispatch, which goes on to the opcode at the position in eax */
+void jit_dispatch(struct jit_buf *b, int dispatch)
+{
+	int at = jit_jump(b, -1);
+	int32_t rel = dispatch - b->count;
+	memcpy(b->code + at, &rel, 4);
+}
+
+/* Return to the VM to carry on from pc */
+void jit_exit(struct jit_buf *b, int pc)
+{
+	/* mov eax, pc; pop rbx; ret */
+	jit_u8(b, 0xB8);
+	jit_u32(b, pc);
+	jit_emit(b, "\x5B\xC3", 2);
+}
+
+/*
+ * Emit the inline form of calling the builtin fn, one of the arithmetic and
+ * comparison builtins, on the top three values. Anything other than fn and two
+ * immediates, or a result too large for an immediate, jumps to the returned
+ * offset for the general case.
+ */
+int jit_arith(struct jit_buf *b, lbuiltin fn)
+{
+	/* mov rdx, &vm_sp; movsxd rax, [rdx] */
+	jit_emit(b, "\x48\xBA", 2);
+	jit_u64(b, (uint64_t)(uintptr_t)&vm_sp);
+	jit_emit(b, "\x48\x63\x02", 3);
+	/* mov rcx, &vm_stack; mov rcx, [rcx]; lea rcx, [rcx + rax * 8 - 24] */
+	jit_emit(b, "\x48\xB9", 2);
+	jit_u64(b, (uint64_t)(uintptr_t)&vm_stack);
+	jit_emit(b, "\x48\x8B\x09\x48\x8D\x4C\xC1\xE8", 8);
+	/* mov r8, [rcx]; mov r9, [rcx + 8]; mov r10, [rcx + 16] */
+	jit_emit(b, "\x4C\x8B\x01\x4C\x8B\x49\x08\x4C\x8B\x51\x10", 11);
+
+	int slow[8];
+	int n = 0;
+
+	/* The function must be the builtin fn, which someone else also owns */
+	jit_emit(b, "\x41\xF6\xC0\x01", 4);
+	slow[n++] = jit_jump(b, JIT_NE);
+	jit_emit(b, "\x41\x80\x78", 3);
+	jit_u8(b, offsetof(lval, type));
+	jit_u8(b, LVAL_FUN);
+	slow[n++] = jit_jump(b, JIT_NE);
+	jit_emit(b, "\x41\xF6\x40", 3);
+	jit_u8(b, offsetof(lval, flags));
+	jit_u8(b, LVAL_BUILTIN);
+	slow[n++] = jit_jump(b, JIT_E);
+	jit_emit(b, "\x41\x83\x78", 3);
+	jit_u8(b, offsetof(lval, refs));
+	jit_u8(b, 1);
+	slow[n++] = jit_jump(b, JIT_LE);
+	jit_emit(b, "\x49\xBB", 2);
+	jit_u64(b, (uint64_t)(uintptr_t)fn);
+	jit_emit(b, "\x4D\x39\x58", 3);
+	jit_u8(b, offsetof(lval, builtin));
+	slow[n++] = jit_jump(b, JIT_NE);
+
+	/* Both arguments must be immediates */
+	jit_emit(b, "\x41\xF6\xC1\x01", 4);
+	slow[n++] = jit_jump(b, JIT_E);
+	jit_emit(b, "\x41\xF6\xC2\x01", 4);
+	slow[n++] = jit_jump(b, JIT_E);
+
+	/* Work on the tagged values directly, leaving the result in rax */
+	if (fn == builtin_add)
+	{
+		/* mov rax, r9; sub rax, 1; add rax, r10 */
+		jit_emit(b, "\x4C\x89\xC8\x48\x83\xE8\x01\x4C\x01\xD0", 10);
+		slow[n++] = jit_jump(b, JIT_O);
+	}
+	else if (fn == builtin_sub)
+	{
+		/* mov rax, r9; sub rax, r10; then add rax, 1 */
+		jit_emit(b, "\x4C\x89\xC8\x4C\x29\xD0", 6);
+		slow[n++] = jit_jump(b, JIT_O);
+		jit_emit(b, "\x48\x83\xC0\x01", 4);
+	}
+	else if (fn == builtin_mul)
+	{
+		/* mov rax, r9; sar rax, 1; mov r11, r10; sub r11, 1; imul rax, r11; then add rax, 1 */
+		jit_emit(b, "\x4C\x89\xC8\x48\xD1\xF8\x4D\x89\xD3\x49\x83\xEB\x01\x49\x0F\xAF\xC3", 17);
+		slow[n++] = jit_jump(b, JIT_O);
+		jit_emit(b, "\x48\x83\xC0\x01", 4);
+	}
+	else
+	{
+		int cc = fn == builtin_lt ? 0xC : fn == builtin_gt ? 0xF : fn == builtin_le ? 0xE : fn == builtin_ge ? 0xD : fn == builtin_eq ? 0x4 : 0x5;
+		/* xor eax, eax; cmp r9, r10; setcc al; lea rax, [rax * 2 + 1] */
+		jit_emit(b, "\x31\xC0\x4D\x39\xD1\x0F", 6);
+		jit_u8(b, 0x90 | cc);
+		jit_emit(b, "\xC0\x48\x8D\x04\x45\x01\x00\x00\x00", 9);
+	}
+
+	/* mov [rcx], rax; sub dword [rdx], 2; dec dword [r8 + refs] */
+	jit_emit(b, "\x48\x89\x01\x83\x2A\x02\x41\xFF\x48", 9);
+	jit_u8(b, offsetof(lval, refs));
+	int done = jit_jump(b, -1);
+
+	for (int i = 0; i < n; i++)
+	{
+		jit_land(b, slow[i]);
+	}
+	return done;
+}
+
+FILE *jit_perf_map = NULL;
+int jit_count = 0;
+
+/* Compile c to machine code, leaving it to the VM if anything fails */
+void jit_compile(lcode *c)
+{
+	struct jit_buf b = {0};
+
+	/* Where the code for each opcode starts */
+	int *at = malloc(sizeof(int) * c->count);
+	for (int pc = 0; pc < c->count; pc++)
+	{
+		at[pc] = -1;
+	}
+
+	/* Enter at the code for the opcode at pc: push rbx; mov eax, edi */
+	jit_emit(&b, "\x53\x89\xF8", 3);
+
+	/* Go to the code for the opcode at eax: movsxd rax, eax; mov rcx, table; jmp [rcx + rax * 8] */
+	int dispatch = b.count;
+	jit_emit(&b, "\x48\x63\xC0\x48\xB9", 5);
+	int table_at = b.count;
+	jit_u64(&b, 0);
+	jit_emit(&b, "\xFF\x24\xC1", 3);
+
+	for (int pc = 0; pc < c->count; pc = c->insns[pc].next)
+	{
+		struct vm_insn *in = &c->insns[pc];
+		at[pc] = b.count;
+
+		switch (c->ops[pc])
+		{
+		case OP_CONST:
+		case OP_LOAD:
+		case OP_LAMBDA:
+			jit_call_insn(&b, in);
+			break;
+
+		case OP_GUARD:
+		case OP_DROP:
+			jit_call_insn(&b, in);
+			jit_cmp_pc(&b, in->alt);
+			jit_jump_pc(&b, JIT_E, in->alt);
+			break;
+
+		case OP_BRANCH:
+			jit_call_insn(&b, in);
+			jit_cmp_pc(&b, in->alt);
+			jit_jump_pc(&b, JIT_E, in->alt);
+			jit_cmp_pc(&b, in->end);
+			jit_jump_pc(&b, JIT_E, in->end);
+			break;
+
+		case OP_JUMP:
+			jit_jump_pc(&b, -1, in->alt);
+			break;
+
+		case OP_SWITCH:
+			/* Go on to the clause the handler chose through the dispatch table */
+			jit_call_insn(&b, in);
+			jit_dispatch(&b, dispatch);
+			break;
+
+		case OP_CALL:
+		{
+			int done = -1;
+			if (in->fn)
+			{
+				done = jit_arith(&b, in->fn);
+			}
+
+			/*
+			 * Otherwise the handler calls builtins and leaves anything else to the
+			 * VM. Handlers fused with the 'if' after them go on to one of its branches.
+			 */
+			jit_call_insn(&b, in);
+			jit_cmp_pc(&b, in->next);
+			int called = jit_jump(&b, JIT_E);
+			jit_cmp_pc(&b, -1);
+			int branched = jit_jump(&b, JIT_NE);
+			jit_exit(&b, pc);
+			jit_land(&b, branched);
+			jit_dispatch(&b, dispatch);
+			jit_land(&b, called);
+			if (done >= 0)
+			{
+				jit_land(&b, done);
+			}
+			break;
+		}
+
+		default:
+			jit_exit(&b, pc);
+			break;
 		}
 	}
 
-	/* Check correct number of symbols and values */
-	LASSERT(a, syms->count == a->count - 1, "Function '%s' cannot define incorrect number of values to symbols. Got %i symbols but %i values.", func, syms->count, a->count - 1);
+	for (int i = 0; i < b.fixups_count; i++)
+	{
+		int32_t rel = at[b.fixups_pc[i]] - (b.fixups_at[i] + 4);
+		memcpy(b.code + b.fixups_at[i], &rel, 4);
+	}
 
-	/* Assign copies of values to symbols */
-	for (int i = 0; i < syms->count; ++i)
+	/* The table of entry points follows the code */
+	int code_size = (b.count + 7) & ~7;
+	size_t size = code_size + sizeof(uint64_t) * c->count;
+	unsigned char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem != MAP_FAILED)
 	{
-		if (strcmp(func, "def") == 0)
+		memcpy(mem, b.code, b.count);
+		uint64_t *table = (uint64_t *)(mem + code_size);
+		for (int pc = 0; pc < c->count; pc++)
 		{
-			lenv_def(e, syms->cell[i], a->cell[i + 1]);
+			table[pc] = at[pc] >= 0 ? (uint64_t)(uintptr_t)(mem + at[pc]) : 0;
 		}
-		if (strcmp(func, "=") == 0)
+		uint64_t t = (uint64_t)(uintptr_t)table;
+		memcpy(mem + table_at, &t, 8);
+
+		if (mprotect(mem, size, PROT_READ | PROT_EXEC) == 0)
+		{
+			c->native = (ljit_fn)mem;
+			c->native_mem = mem;
+			c->native_size = size;
+
+			/* Let perf name the code */
+			if (!jit_perf_map)
+			{
+				char path[64];
+				snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+				jit_perf_map = fopen(path, "w");
+			}
+			if (jit_perf_map)
+			{
+				/* By the global the function is bound to, or by number if it has none */
+				char *name = find_lambda(lenv_global, c);
+				if (name)
+				{
+					fprintf(jit_perf_map, "%lx %x lispy:%s\n", (unsigned long)(uintptr_t)mem, b.count, name);
+				}
+				else
+				{
+					fprintf(jit_perf_map, "%lx %x lispy:lambda_%d\n", (unsigned long)(uintptr_t)mem, b.count, jit_count);
+				}
+				fflush(jit_perf_map);
+			}
+			jit_count++;
+		}
+		else
 		{
-			lenv_put(e, syms->cell[i], a->cell[i + 1]);
+			munmap(mem, size);
 		}
 	}
 
-	lval_del(a);
-	return lval_sexpr();
+	free(at);
+	free(b.fixups_at);
+	free(b.fixups_pc);
+	free(b.code);
 }
 
-lval *builtin_def(lenv *e, lval *a)
+#else
+
+/* There is no JIT for other platforms */
+void jit_compile(lcode *c)
 {
-	return builtin_var(e, a, "def");
 }
 
-lval *builtin_put(lenv *e, lval *a)
+#endif
+
+/* Compiling to C */
+
+/*
+ * --emit-c translates a program to C that builds each top level form with the
+ * lval constructors and evaluates it in turn, as 'load' would. Functions whose
+ * bodies only do integer arithmetic, comparisons and 'if' on their formals and
+ * calls of other such functions are also compiled to C functions on longs that
+ * call each other directly. Once defined, calls of them with Numbers skip the VM.
+ *
+ * Under dynamic scope a formal anywhere can shadow any name, so a function is
+ * only compiled if its name is defined once at the top level and never bound
+ * otherwise, and only builtins whose names are never bound are compiled inline.
+ * Definitions made through symbols computed at run time are not seen.
+ */
+
+/* Nested calls of compiled code past which calls run in the VM, keeping the native stack small */
+#define AOT_DEPTH_MAX 10000
+int aot_depth = 0;
+
+/* First error raised in compiled code since it was entered, or NULL */
+lval *aot_err = NULL;
+
+/* Environment compiled programs run in */
+lenv *aot_env = NULL;
+
+void aot_raise(lval *err)
 {
-	return builtin_var(e, a, "=");
+	if (aot_err)
+	{
+		lval_del(err);
+		return;
+	}
+	aot_err = err;
 }
 
-lval *builtin_exit(lenv *e, lval *a)
+long aot_div(long x, long y)
 {
-	return lval_exit();
+	if (y == 0)
+	{
+		aot_raise(lval_err("Division by zero."));
+		return 0;
+	}
+	return x / y;
 }
 
-lval *builtin_deflist(lenv *e, lval *a)
+long aot_unbound(char *name)
 {
-	for (int i = 0; i < e->count; ++i)
+	aot_raise(lval_err("Unbound symbol '%s'", name));
+	return 0;
+}
+
+/* Call lambda f on the n Numbers at a in the VM, for calls too deep to make natively */
+long aot_slow(lval *f, int n, long *a)
+{
+	lval *args = lval_sexpr();
+	for (int i = 0; i < n; i++)
 	{
-		printf("%s\t", e->syms[i]);
+		lval_add(args, lval_num(a[i]));
 	}
-	printf("\n");
-	return lval_sexpr();
+
+	lval *x = lval_call(aot_env, lval_copy(f), args);
+	if (LTYPE(x) != LVAL_NUM)
+	{
+		aot_raise(x);
+		return 0;
+	}
+	long r = LNUM(x);
+	lval_del(x);
+	return r;
 }
 
-lval *builtin_ord(lenv *e, lval *a, char *op)
+/*
+ * If lambda f was compiled to C and the n values at a are Numbers, return the
+ * result of calling the compiled code on them. Otherwise return NULL, leaving
+ * the call to the VM.
+ */
+lval *lval_call_aot(lval *f, lval **a, int n)
 {
-	LASSERT_NUM_ARGS(a, 2, op);
-	LASSERT_TYPE(a, 0, LVAL_NUM, op);
-	LASSERT_TYPE(a, 1, LVAL_NUM, op);
+	lcode *c = f->body->code;
+	if (!c || !c->aot || n != c->aot_arity || f->formals->count != n || f->env->count > 0 || aot_depth >= AOT_DEPTH_MAX)
+	{
+		return NULL;
+	}
 
-	int r = 0;
+	long x[n];
+	for (int i = 0; i < n; i++)
+	{
+		if (LTYPE(a[i]) != LVAL_NUM)
+		{
+			return NULL;
+		}
+		x[i] = LNUM(a[i]);
+	}
 
-	if (strcmp(op, ">") == 0)
+	long r = c->aot(x);
+	if (aot_err)
 	{
-		r = (a->cell[0]->num > a->cell[1]->num);
+		lval *err = aot_err;
+		aot_err = NULL;
+		return err;
 	}
-	else if (strcmp(op, "<") == 0)
+	return lval_num(r);
+}
+
+/* Have calls of the lambda bound to name with n Numbers run fn, and return the lambda, or NULL if name is not bound to one */
+lval *aot_attach(lenv *e, char *name, int n, laot_fn fn)
+{
+	lval *k = lval_sym(name);
+	lval *f = lenv_get(e, k);
+	lval_del(k);
+
+	if (LTYPE(f) != LVAL_FUN || LVAL_IS_BUILTIN(f) || f->formals->count != n || f->env->count > 0)
 	{
-		r = (a->cell[0]->num < a->cell[1]->num);
+		lval_del(f);
+		return NULL;
 	}
-	else if (strcmp(op, ">=") == 0)
+
+	lcode *c = lval_code(f->body);
+	c->aot = fn;
+	c->aot_arity = n;
+	return f;
+}
+
+/* A function the compiler found, with the top level form defining it */
+struct aot_fn
+{
+	char *name;
+	lval *formals;
+	lval *body;
+	int form;
+
+	/* Whether its body can be compiled */
+	int numeric;
+};
+
+struct aot_prog
+{
+	/* Top level forms of all files in order */
+	lval *forms;
+
+	/* Symbols bound as formals or with '=', and those defined with 'def' or 'fun' once per definition */
+	char **locals;
+	int locals_count;
+	char **defs;
+	int defs_count;
+
+	struct aot_fn *fns;
+	int fns_count;
+
+	/* Temporaries used so far by the function being emitted */
+	int temps;
+};
+
+void aot_names_add(char ***names, int *count, char *name)
+{
+	*names = realloc(*names, sizeof(char *) * (*count + 1));
+	(*names)[(*count)++] = name;
+}
+
+int aot_names_count(char **names, int count, char *name)
+{
+	int n = 0;
+	for (int i = 0; i < count; i++)
 	{
-		r = (a->cell[0]->num >= a->cell[1]->num);
+		n += names[i] == name;
 	}
-	else if (strcmp(op, "<=") == 0)
+	return n;
+}
+
+/* Record the symbols that lists in v bind */
+void aot_scan(struct aot_prog *p, lval *v)
+{
+	if (LTYPE(v) != LVAL_SEXPR && LTYPE(v) != LVAL_QEXPR)
 	{
-		r = (a->cell[0]->num <= a->cell[1]->num);
+		return;
 	}
 
-	lval_del(a);
-	return lval_num(r);
+	if (v->count >= 2 && LTYPE(v->cell[0]) == LVAL_SYM && LTYPE(v->cell[1]) == LVAL_QEXPR)
+	{
+		char *head = v->cell[0]->sym;
+		lval *syms = v->cell[1];
+		for (int i = 0; i < syms->count; i++)
+		{
+			if (LTYPE(syms->cell[i]) != LVAL_SYM)
+			{
+				continue;
+			}
+			char *sym = syms->cell[i]->sym;
+			if (head == intern("def") || (head == intern("fun") && i == 0))
+			{
+				aot_names_add(&p->defs, &p->defs_count, sym);
+			}
+			else if (head == intern("\\") || head == intern("=") || head == intern("fun"))
+			{
+				aot_names_add(&p->locals, &p->locals_count, sym);
+			}
+		}
+	}
+
+	for (int i = 0; i < v->count; i++)
+	{
+		aot_scan(p, v->cell[i]);
+	}
 }
 
-lval *builtin_gt(lenv *e, lval *a)
+/* Whether name is only defined once, at the top level, and is never shadowed */
+int aot_fixed(struct aot_prog *p, char *name)
 {
-	return builtin_ord(e, a, ">");
+	return aot_names_count(p->defs, p->defs_count, name) == 1 && aot_names_count(p->locals, p->locals_count, name) == 0;
 }
 
-lval *builtin_lt(lenv *e, lval *a)
+/* Whether name is a builtin that is never shadowed */
+int aot_builtin(struct aot_prog *p, char *name)
 {
-	return builtin_ord(e, a, "<");
+	return aot_names_count(p->locals, p->locals_count, name) == 0;
 }
 
-lval *builtin_ge(lenv *e, lval *a)
+/* Index of the formal named sym in formals, or -1 */
+int aot_formal(lval *formals, lval *sym)
 {
-	return builtin_ord(e, a, ">=");
+	for (int i = 0; i < formals->count; i++)
+	{
+		if (formals->cell[i]->sym == sym->sym)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+/* Index of the compiled function called name taking n arguments, or -1 */
+int aot_callee(struct aot_prog *p, char *name, int n)
+{
+	for (int i = 0; i < p->fns_count; i++)
+	{
+		if (p->fns[i].numeric && p->fns[i].name == name && p->fns[i].formals->count == n)
+		{
+			return i;
+		}
+	}
+	return -1;
+}
+
+int aot_is_arith(struct aot_prog *p, char *sym)
+{
+	return (sym == intern("+") || sym == intern("-") || sym == intern("*") || sym == intern("/")) && aot_builtin(p, sym);
+}
+
+int aot_is_cmp(struct aot_prog *p, char *sym)
+{
+	return (sym == intern("<") || sym == intern(">") || sym == intern("<=") || sym == intern(">=") || sym == intern("==") || sym == intern("!=")) && aot_builtin(p, sym);
+}
+
+/* Whether v, evaluated as the list of an expression in a function with formals, always gives a Number that can be computed in C */
+int aot_numeric_list(struct aot_prog *p, lval *v, lval *formals);
+
+int aot_numeric(struct aot_prog *p, lval *v, lval *formals)
+{
+	switch (LTYPE(v))
+	{
+	case LVAL_NUM:
+		return 1;
+	case LVAL_SYM:
+		return aot_formal(formals, v) >= 0;
+	case LVAL_SEXPR:
+		return aot_numeric_list(p, v, formals);
+	default:
+		return 0;
+	}
+}
+
+int aot_numeric_list(struct aot_prog *p, lval *v, lval *formals)
+{
+	if (v->count == 1)
+	{
+		return aot_numeric(p, v->cell[0], formals);
+	}
+	if (v->count < 2 || LTYPE(v->cell[0]) != LVAL_SYM || aot_formal(formals, v->cell[0]) >= 0)
+	{
+		return 0;
+	}
+
+	char *head = v->cell[0]->sym;
+	if (head == intern("if") && aot_builtin(p, head))
+	{
+		return v->count == 4 && aot_numeric(p, v->cell[1], formals) && LTYPE(v->cell[2]) == LVAL_QEXPR && aot_numeric_list(p, v->cell[2], formals) && LTYPE(v->cell[3]) == LVAL_QEXPR && aot_numeric_list(p, v->cell[3], formals);
+	}
+	if (!aot_is_arith(p, head) && !(aot_is_cmp(p, head) && v->count == 3) && aot_callee(p, head, v->count - 1) < 0)
+	{
+		return 0;
+	}
+	for (int i = 1; i < v->count; i++)
+	{
+		if (!aot_numeric(p, v->cell[i], formals))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void aot_indent(int indent)
+{
+	for (int i = 0; i < indent; i++)
+	{
+		putchar('\t');
+	}
+}
+
+/* Print s as a C string literal */
+void aot_print_str(char *s)
+{
+	putchar('"');
+	for (; *s; s++)
+	{
+		unsigned char c = *s;
+		/* Escaping '?' keeps trigraphs such as ??= from being replaced, as they are under -std=c99 */
+		if (c == '"' || c == '\\' || c == '?')
+		{
+			printf("\\%c", c);
+		}
+		else if (c < ' ' || c > '~')
+		{
+			printf("\\%03o", c);
+		}
+		else
+		{
+			putchar(c);
+		}
+	}
+	putchar('"');
+}
+
+/* Print s inside a C comment, which it must neither end nor nest another in */
+void aot_print_comment(char *s)
+{
+	for (; *s; s++)
+	{
+		unsigned char c = *s;
+		if (c < ' ' || c > '~')
+		{
+			putchar('_');
+		}
+		else if ((c == '*' && s[1] == '/') || (c == '/' && s[1] == '*'))
+		{
+			printf("%c ", c);
+		}
+		else
+		{
+			putchar(c);
+		}
+	}
+}
+
+void aot_print_num(long x)
+{
+	if (x == LONG_MIN)
+	{
+		printf("LONG_MIN");
+	}
+	else
+	{
+		printf("%liL", x);
+	}
+}
+
+/* Emit statements computing v into a new temporary and return its number */
+int aot_emit_list(struct aot_prog *p, lval *v, lval *formals, int indent);
+
+int aot_emit_expr(struct aot_prog *p, lval *v, lval *formals, int indent)
+{
+	if (LTYPE(v) == LVAL_SEXPR)
+	{
+		return aot_emit_list(p, v, formals, indent);
+	}
+
+	int t = p->temps++;
+	aot_indent(indent);
+	printf("long t%i = ", t);
+	if (LTYPE(v) == LVAL_NUM)
+	{
+		aot_print_num(LNUM(v));
+	}
+	else
+	{
+		printf("a%i", aot_formal(formals, v));
+	}
+	printf(";\n");
+	return t;
+}
+
+int aot_emit_list(struct aot_prog *p, lval *v, lval *formals, int indent)
+{
+	if (v->count == 1)
+	{
+		return aot_emit_expr(p, v->cell[0], formals, indent);
+	}
+
+	char *head = v->cell[0]->sym;
+	if (head == intern("if"))
+	{
+		int cond = aot_emit_expr(p, v->cell[1], formals, indent);
+		int t = p->temps++;
+		aot_indent(indent);
+		printf("long t%i;\n", t);
+		for (int i = 2; i < 4; i++)
+		{
+			aot_indent(indent);
+			printf(i == 2 ? "if (t%i)\n" : "else\n", cond);
+			aot_indent(indent);
+			printf("{\n");
+			int x = aot_emit_list(p, v->cell[i], formals, indent + 1);
+			aot_indent(indent + 1);
+			printf("t%i = t%i;\n", t, x);
+			aot_indent(indent);
+			printf("}\n");
+		}
+		return t;
+	}
+
+	/* Arguments are evaluated in order, as the VM does */
+	int args[v->count];
+	for (int i = 1; i < v->count; i++)
+	{
+		args[i] = aot_emit_expr(p, v->cell[i], formals, indent);
+	}
+
+	int t = p->temps++;
+	aot_indent(indent);
+	if (aot_is_arith(p, head))
+	{
+		printf("long t%i = t%i;\n", t, args[1]);
+		if (head == intern("-") && v->count == 2)
+		{
+			aot_indent(indent);
+			printf("t%i = (long)(0UL - (unsigned long)t%i);\n", t, t);
+		}
+		for (int i = 2; i < v->count; i++)
+		{
+			aot_indent(indent);
+			if (head == intern("/"))
+			{
+				printf("t%i = aot_div(t%i, t%i);\n", t, t, args[i]);
+			}
+			else
+			{
+				/* Overflow wraps around as it does in the builtins */
+				printf("t%i = (long)((unsigned long)t%i %s (unsigned long)t%i);\n", t, t, head, args[i]);
+			}
+		}
+	}
+	else if (aot_is_cmp(p, head))
+	{
+		printf("long t%i = t%i %s t%i;\n", t, args[1], head, args[2]);
+	}
+	else
+	{
+		/* A function called before it is defined is unbound */
+		int f = aot_callee(p, head, v->count - 1);
+		printf("long t%i = aot_fun_%i ? aot_fn_%i(", t, f, f);
+		for (int i = 1; i < v->count; i++)
+		{
+			printf(i > 1 ? ", t%i" : "t%i", args[i]);
+		}
+		printf(") : aot_unbound(");
+		aot_print_str(head);
+		printf(");\n");
+	}
+	return t;
 }
 
-lval *builtin_le(lenv *e, lval *a)
+void aot_emit_signature(struct aot_fn *fn, int i)
 {
-	return builtin_ord(e, a, "<=");
+	printf("long aot_fn_%i(", i);
+	for (int j = 0; j < fn->formals->count; j++)
+	{
+		printf(j ? ", long a%i" : "long a%i", j);
+	}
+	printf(")");
 }
 
-int lval_eq(lval *x, lval *y)
+void aot_emit_fn(struct aot_prog *p, int i)
 {
-	if (x->type != y->type)
+	struct aot_fn *fn = &p->fns[i];
+	int n = fn->formals->count;
+
+	aot_emit_signature(fn, i);
+	printf("\n{\n");
+	printf("\tif (aot_err)\n\t{\n\t\treturn 0;\n\t}\n");
+	printf("\tif (aot_depth >= AOT_DEPTH_MAX)\n\t{\n");
+	printf("\t\tlong a[] = {");
+	for (int j = 0; j < n; j++)
 	{
-		return 0;
+		printf(j ? ", a%i" : "a%i", j);
 	}
+	printf("};\n\t\treturn aot_slow(aot_fun_%i, %i, a);\n\t}\n\n", i, n);
 
-	switch (x->type)
+	printf("\taot_depth++;\n");
+	p->temps = 0;
+	int t = aot_emit_list(p, fn->body, fn->formals, 1);
+	printf("\taot_depth--;\n");
+	printf("\treturn t%i;\n}\n\n", t);
+
+	printf("long aot_entry_%i(long *a)\n{\n\treturn aot_fn_%i(", i, i);
+	for (int j = 0; j < n; j++)
+	{
+		printf(j ? ", a[%i]" : "a[%i]", j);
+	}
+	printf(");\n}\n\n");
+}
+
+/* Emit statements building v in s[d] */
+void aot_emit_build(lval *v, int d)
+{
+	printf("\ts[%i] = ", d);
+	switch (LTYPE(v))
 	{
 	case LVAL_NUM:
-		return (x->num == y->num);
-	case LVAL_ERR:
-		return strcmp(x->err, y->err) == 0;
+		printf("lval_num(");
+		aot_print_num(LNUM(v));
+		break;
 	case LVAL_SYM:
-		return strcmp(x->sym, y->sym) == 0;
+		printf("lval_sym(");
+		aot_print_str(v->sym);
+		break;
 	case LVAL_STR:
-		return strcmp(x->str, y->str) == 0;
-	case LVAL_FUN:
-		if (x->builtin || y->builtin)
-		{
-			return x->builtin == y->builtin;
-		}
-		return lval_eq(x->formals, y->formals) && lval_eq(x->body, y->body);
+		printf("lval_str(");
+		aot_print_str(v->str);
+		break;
+	case LVAL_ERR:
+		printf("lval_err(\"%%s\", ");
+		aot_print_str(v->err);
+		break;
 	case LVAL_QEXPR:
-	case LVAL_SEXPR:
-		if (x->count != y->count)
-		{
-			return 0;
-		}
-		for (int i = 0; i < x->count; i++)
+		printf("lval_qexpr(");
+		break;
+	default:
+		printf("lval_sexpr(");
+		break;
+	}
+	printf(");\n");
+
+	if (LTYPE(v) == LVAL_SEXPR || LTYPE(v) == LVAL_QEXPR)
+	{
+		for (int i = 0; i < v->count; i++)
 		{
-			if (!lval_eq(x->cell[i], y->cell[i]))
-			{
-				return 0;
-			}
+			aot_emit_build(v->cell[i], d + 1);
+			printf("\tlval_add(s[%i], s[%i]);\n", d, d + 1);
 		}
-		return 1;
-	case LVAL_EXIT:
-		return 1;
 	}
-
-	return 0;
 }
 
-lval *builtin_cmp(lenv *e, lval *a, char *op)
+int lval_nesting(lval *v)
 {
-	LASSERT_NUM_ARGS(a, 2, op);
-
-	int r = 0;
-
-	if (strcmp(op, "==") == 0)
-	{
-		r = lval_eq(a->cell[0], a->cell[1]);
-	}
-	else if (strcmp(op, "!=") == 0)
+	int n = 0;
+	if (LTYPE(v) == LVAL_SEXPR || LTYPE(v) == LVAL_QEXPR)
 	{
-		r = !lval_eq(a->cell[0], a->cell[1]);
+		for (int i = 0; i < v->count; i++)
+		{
+			int m = lval_nesting(v->cell[i]);
+			n = m > n ? m : n;
+		}
 	}
-
-	lval_del(a);
-	return lval_num(r);
-}
-
-lval *builtin_eq(lenv *e, lval *a)
-{
-	return builtin_cmp(e, a, "==");
-}
-
-lval *builtin_ne(lenv *e, lval *a)
-{
-	return builtin_cmp(e, a, "!=");
+	return n + 1;
 }
 
-lval *builtin_if(lenv *e, lval *a)
+/* If form defines a function the way the prelude's 'fun' or a 'def' of a lambda does, record it */
+void aot_find_fn(struct aot_prog *p, lval *form, int i, int has_fun)
 {
-	LASSERT_NUM_ARGS(a, 3, "if");
-	LASSERT_TYPE(a, 0, LVAL_NUM, "if");
-	LASSERT_TYPE(a, 1, LVAL_QEXPR, "if");
-	LASSERT_TYPE(a, 2, LVAL_QEXPR, "if");
-
-	lval *x;
-	a->cell[1]->type = LVAL_SEXPR;
-	a->cell[2]->type = LVAL_SEXPR;
+	if (LTYPE(form) != LVAL_SEXPR || form->count != 3 || LTYPE(form->cell[0]) != LVAL_SYM || LTYPE(form->cell[1]) != LVAL_QEXPR)
+	{
+		return;
+	}
 
-	if (a->cell[0]->num)
+	char *head = form->cell[0]->sym;
+	lval *syms = form->cell[1];
+	lval *formals;
+	lval *body;
+	if (head == intern("fun") && has_fun && syms->count >= 2 && LTYPE(form->cell[2]) == LVAL_QEXPR)
+	{
+		formals = syms;
+		body = form->cell[2];
+	}
+	else if (head == intern("def") && aot_builtin(p, head) && syms->count == 1)
 	{
-		x = lval_eval(e, lval_pop(a, 1));
+		lval *x = form->cell[2];
+		if (LTYPE(x) != LVAL_SEXPR || x->count != 3 || LTYPE(x->cell[0]) != LVAL_SYM || x->cell[0]->sym != intern("\\") || !aot_builtin(p, x->cell[0]->sym) || LTYPE(x->cell[1]) != LVAL_QEXPR || LTYPE(x->cell[2]) != LVAL_QEXPR || x->cell[1]->count == 0)
+		{
+			return;
+		}
+		formals = x->cell[1];
+		body = x->cell[2];
 	}
 	else
 	{
-		x = lval_eval(e, lval_pop(a, 2));
+		return;
 	}
 
-	lval_del(a);
-	return x;
-}
-
-lval *builtin_or(lenv *e, lval *a)
-{
-	LASSERT_NUM_ARGS(a, 2, "||");
-	LASSERT_TYPE(a, 0, LVAL_NUM, "||");
-	LASSERT_TYPE(a, 1, LVAL_NUM, "||");
+	/* Formals are bound in order, so each must be a distinct symbol other than '&' */
+	int skip = formals == syms;
+	for (int j = 0; j < syms->count; j++)
+	{
+		if (LTYPE(syms->cell[j]) != LVAL_SYM)
+		{
+			return;
+		}
+	}
+	for (int j = skip; j < formals->count; j++)
+	{
+		if (LTYPE(formals->cell[j]) != LVAL_SYM || formals->cell[j]->sym == sym_varargs)
+		{
+			return;
+		}
+		for (int k = skip; k < j; k++)
+		{
+			if (formals->cell[k]->sym == formals->cell[j]->sym)
+			{
+				return;
+			}
+		}
+	}
 
-	int r = a->cell[0]->num != 0 || a->cell[1]->num != 0;
+	char *name = syms->cell[0]->sym;
+	if (!aot_fixed(p, name) || body->count == 0)
+	{
+		return;
+	}
 
-	lval_del(a);
-	return lval_num(r);
+	p->fns = realloc(p->fns, sizeof(struct aot_fn) * (p->fns_count + 1));
+	struct aot_fn *fn = &p->fns[p->fns_count++];
+	fn->name = name;
+	fn->formals = lval_unshare(lval_copy(formals));
+	if (skip)
+	{
+		lval_del(lval_pop(fn->formals, 0));
+	}
+	fn->body = body;
+	fn->form = i;
+	fn->numeric = 1;
 }
 
-lval *builtin_and(lenv *e, lval *a)
+/* Whether the program's 'fun' is the builtin */
+int aot_has_fun(struct aot_prog *p)
 {
-	LASSERT_NUM_ARGS(a, 2, "&&");
-	LASSERT_TYPE(a, 0, LVAL_NUM, "&&");
-	LASSERT_TYPE(a, 1, LVAL_NUM, "&&");
-
-	int r = a->cell[0]->num != 0 && a->cell[1]->num != 0;
-
-	lval_del(a);
-	return lval_num(r);
+	return aot_builtin(p, intern("fun")) && aot_names_count(p->defs, p->defs_count, intern("fun")) == 0;
 }
 
-lval *builtin_not(lenv *e, lval *a)
+/* Name of the source programs include for the runtime, found on their include path rather than where it was built */
+char *aot_runtime(void)
 {
-	LASSERT_NUM_ARGS(a, 1, "!");
-	LASSERT_TYPE(a, 0, LVAL_NUM, "!");
-
-	int r = a->cell[0]->num == 0;
-
-	lval_del(a);
-	return lval_num(r);
+	char *name = __FILE__;
+	for (char *s = __FILE__; *s; s++)
+	{
+		if (*s == '/' || *s == '\\')
+		{
+			name = s + 1;
+		}
+	}
+	return name;
 }
 
-lval *builtin_load(lenv *e, lval *a)
+/* Print C for the program made of forms, read from the n files */
+void aot_emit(lval *forms, char **files, int n)
 {
-	LASSERT_NUM_ARGS(a, 1, "load");
-	LASSERT_TYPE(a, 0, LVAL_STR, "load");
+	struct aot_prog prog = {0};
+	struct aot_prog *p = &prog;
+	p->forms = forms;
 
-	mpc_result_t r;
-	if (mpc_parse_contents(a->cell[0]->str, Lispy, &r))
+	for (int i = 0; i < forms->count; i++)
 	{
-		lval *expr = lval_read(r.output);
-		mpc_ast_delete(r.output);
+		aot_scan(p, forms->cell[i]);
+	}
+	int has_fun = aot_has_fun(p);
+	for (int i = 0; i < forms->count; i++)
+	{
+		aot_find_fn(p, forms->cell[i], i, has_fun);
+	}
 
-		while (expr->count)
+	/* Drop functions that do anything else, until only those calling each other are left */
+	for (int changed = 1; changed;)
+	{
+		changed = 0;
+		for (int i = 0; i < p->fns_count; i++)
 		{
-			lval *x = lval_eval(e, lval_pop(expr, 0));
-			if (x->type == LVAL_ERR)
+			if (p->fns[i].numeric && !aot_numeric_list(p, p->fns[i].body, p->fns[i].formals))
 			{
-				lval_println(e, x);
+				p->fns[i].numeric = 0;
+				changed = 1;
 			}
-			lval_del(x);
 		}
-
-		lval_del(expr);
-		lval_del(a);
-		return lval_sexpr();
-	}
-	else
-	{
-		char *err_msg = mpc_err_string(r.error);
-		mpc_err_delete(r.error);
-
-		lval *err = lval_err("Could not load library %s", err_msg);
-
-		free(err_msg);
-		lval_del(a);
-		return err;
 	}
-}
 
-lval *builtin_print(lenv *e, lval *a)
-{
-	for (int i = 0; i < a->count; i++)
+	printf("/*\n * Generated by --emit-c from");
+	for (int i = 0; i < n; i++)
 	{
-		lval_print(e, a->cell[i]);
 		putchar(' ');
+		aot_print_comment(files[i]);
 	}
-	putchar('\n');
-
-	lval_del(a);
-	return lval_sexpr();
-}
-
-lval *builtin_error(lenv *e, lval *a)
-{
-	LASSERT_NUM_ARGS(a, 1, "error");
-	LASSERT_TYPE(a, 0, LVAL_STR, "error");
+	printf(".\n * Build with the directory of the interpreter's sources as <lispy>:\n");
+	printf(" *   cc -std=c99 -O2 -I<lispy> <this file> <lispy>/lib/mpc.c -ledit\n */\n\n");
+	printf("#define LISPY_NO_MAIN\n#include ");
+	aot_print_str(aot_runtime());
+	printf("\n\n");
 
-	lval *err = lval_err(a->cell[0]->str);
+	for (int i = 0; i < p->fns_count; i++)
+	{
+		if (p->fns[i].numeric)
+		{
+			printf("/* ");
+			aot_print_comment(p->fns[i].name);
+			printf(" */\nlval *aot_fun_%i = NULL;\n", i);
+			aot_emit_signature(&p->fns[i], i);
+			printf(";\n\n");
+		}
+	}
+	for (int i = 0; i < p->fns_count; i++)
+	{
+		if (p->fns[i].numeric)
+		{
+			aot_emit_fn(p, i);
+		}
+	}
 
-	lval_del(a);
-	return err;
-}
+	for (int i = 0; i < forms->count; i++)
+	{
+		printf("lval *aot_form_%i(void)\n{\n\tlval *s[%i];\n", i, lval_nesting(forms->cell[i]));
+		aot_emit_build(forms->cell[i], 0);
+		printf("\treturn s[0];\n}\n\n");
+	}
 
-char *find_builtin(lenv *e, lbuiltin b)
-{
-	for (int i = 0; i < e->count; ++i)
+	printf("int main(int argc, char **argv)\n{\n\tlenv *e = lispy_init();\n\taot_env = e;\n");
+	/* The program runs with the scope it was translated with */
+	if (!lenv_lexical)
+	{
+		printf("\tlenv_lexical = 0;\n");
+	}
+	printf("\n");
+	for (int i = 0; i < forms->count; i++)
 	{
-		if (e->vals[i]->builtin == b)
+		printf("\tload_eval(e, aot_form_%i());\n", i);
+		for (int j = 0; j < p->fns_count; j++)
 		{
-			return e->syms[i];
+			if (p->fns[j].numeric && p->fns[j].form == i)
+			{
+				printf("\taot_fun_%i = aot_attach(e, ", j);
+				aot_print_str(p->fns[j].name);
+				printf(", %i, aot_entry_%i);\n", p->fns[j].formals->count, j);
+			}
 		}
 	}
-	return "unknown";
+	printf("\n\tlispy_cleanup(e);\n\treturn 0;\n}\n");
+
+	for (int i = 0; i < p->fns_count; i++)
+	{
+		lval_del(p->fns[i].formals);
+	}
+	free(p->fns);
+	free(p->locals);
+	free(p->defs);
 }
 
 void lenv_add_builtin(lenv *e, char *name, lbuiltin func)
 {
 	lval *k = lval_sym(name);
-	lval *v = lval_builtin(func);
-	lenv_put(e, k, v);
+	lenv_put_move(e, k, lval_builtin(func));
 	lenv_put_builtin(e, k);
 	lval_del(k);
-	lval_del(v);
 }
 
 void lenv_add_builtins(lenv *e)
@@ -1375,6 +5801,8 @@ void lenv_add_builtins(lenv *e)
 	lenv_add_builtin(e, "==", builtin_eq);
 	lenv_add_builtin(e, "!=", builtin_ne);
 	lenv_add_builtin(e, "if", builtin_if);
+	lenv_add_builtin(e, "select", builtin_select);
+	lenv_add_builtin(e, "case", builtin_case);
 	lenv_add_builtin(e, "||", builtin_or);
 	lenv_add_builtin(e, "&&", builtin_and);
 	lenv_add_builtin(e, "!", builtin_not);
@@ -1384,6 +5812,9 @@ void lenv_add_builtins(lenv *e)
 	lenv_add_builtin(e, "deflist", builtin_deflist);
 	lenv_add_builtin(e, "\\", builtin_lambda);
 	lenv_add_builtin(e, "=", builtin_put);
+	lenv_add_builtin(e, "fun", builtin_fun);
+	lenv_add_builtin(e, "let", builtin_let);
+	lenv_add_builtin(e, "do", builtin_do);
 
 	/* String functions */
 	lenv_add_builtin(e, "load", builtin_load);
@@ -1392,9 +5823,11 @@ void lenv_add_builtins(lenv *e)
 
 	/* Application functions */
 	lenv_add_builtin(e, "exit", builtin_exit);
+	lenv_add_builtin(e, "memstats", builtin_memstats);
 }
 
-int main(int argc, char **argv)
+/* Create the parsers and the global environment, shared by the interpreter and programs compiled with --emit-c */
+lenv *lispy_init(void)
 {
 	/* Create some parsers */
 	Number = mpc_new("number");
@@ -1420,10 +5853,93 @@ int main(int argc, char **argv)
 		",
 			  Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
 
+	sym_varargs = intern("&");
+	sym_put = intern("=");
+
 	lenv *e = lenv_new();
+	lenv_global = e;
 	lenv_add_builtins(e);
+	return e;
+}
+
+void lispy_cleanup(lenv *e)
+{
+	/* Break any cycles left, so that everything goes with the global environment */
+	lval_collect(NULL);
+	lenv_del(e);
+	/* Undefine and delete our parsers */
+	mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+}
+
+/* Programs compiled with --emit-c include this file for the runtime and bring their own main */
+#ifndef LISPY_NO_MAIN
+
+int main(int argc, char **argv)
+{
+	lenv *e = lispy_init();
+
+	/* Options come before any files to load */
+	int emit_c = 0;
+	int first = 1;
+	for (; first < argc && strncmp(argv[first], "--", 2) == 0; first++)
+	{
+		if (strncmp(argv[first], "--stack-limit=", 14) == 0)
+		{
+			/* Given in megabytes, as a positive whole number whose size in bytes fits a long */
+			char *mb_str = argv[first] + 14;
+			char *end;
+			errno = 0;
+			long mb = strtol(mb_str, &end, 10);
+			if (*mb_str < '0' || *mb_str > '9' || errno || *end || mb <= 0 || mb > LONG_MAX / (1024 * 1024))
+			{
+				fprintf(stderr, "Invalid option %s\n", argv[first]);
+				return 1;
+			}
+			vm_stack_limit = mb * 1024 * 1024;
+		}
+		else if (strcmp(argv[first], "--lexical") == 0)
+		{
+			lenv_lexical = 1;
+		}
+		else if (strcmp(argv[first], "--dynamic") == 0)
+		{
+			lenv_lexical = 0;
+		}
+		else if (strcmp(argv[first], "--no-jit") == 0)
+		{
+			jit_enabled = 0;
+		}
+		else if (strcmp(argv[first], "--emit-c") == 0)
+		{
+			emit_c = 1;
+		}
+		else
+		{
+			fprintf(stderr, "Unknown option %s\n", argv[first]);
+			return 1;
+		}
+	}
 
-	if (argc == 1)
+	if (emit_c)
+	{
+		/* Translate the files to C on stdout rather than running them */
+		lval *forms = lval_sexpr();
+		for (int i = first; i < argc; i++)
+		{
+			mpc_result_t r;
+			if (!mpc_parse_contents(argv[i], Lispy, &r))
+			{
+				mpc_err_print_to(r.error, stderr);
+				mpc_err_delete(r.error);
+				return 1;
+			}
+			forms = lval_join(forms, lval_read(r.output));
+			mpc_ast_delete(r.output);
+		}
+		aot_emit(forms, argv + first, argc - first);
+		lval_del(forms);
+	}
+	else if (first == argc)
 	{
 		puts("Lispy version 0.0.0.0.10");
 		puts("Press Ctrl+c to exit\n");
@@ -1439,8 +5955,12 @@ int main(int argc, char **argv)
 			mpc_result_t r;
 			if (mpc_parse("<stdin>", input, Lispy, &r))
 			{
-				lval *x = lval_eval(e, lval_read(r.output));
-				if (x->type == LVAL_EXIT)
+				if (lval_boxes_made)
+				{
+					lval_collect(e);
+				}
+				lval *x = vm_eval(e, lval_read(r.output));
+				if (LTYPE(x) == LVAL_EXIT)
 				{
 					repeat = 0;
 				}
@@ -1463,11 +5983,11 @@ int main(int argc, char **argv)
 	}
 	else
 	{
-		for (int i = 1; i < argc; i++)
+		for (int i = first; i < argc; i++)
 		{
 			lval *args = lval_add(lval_sexpr(), lval_str(argv[i]));
 			lval *x = builtin_load(e, args);
-			if (x->type == LVAL_ERR)
+			if (LTYPE(x) == LVAL_ERR)
 			{
 				lval_println(e, x);
 			}
@@ -1475,9 +5995,8 @@ int main(int argc, char **argv)
 		}
 	}
 
-	lenv_del(e);
-	/* Undefine and delete our parsers */
-	mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
-
+	lispy_cleanup(e);
 	return 0;
 }
+
+#endif